@@ -41,6 +41,46 @@ struct kfio_disk
     fusion_condvar_t             bio_cv;
     fusion_cv_lock_t             bio_lock;
     struct bio_queue_head       *bio_queue;
+
+    /*
+     * Background discard queue. BIO_DELETE requests are parked here and
+     * only fed to the core when foreground I/O is light, at no more than
+     * discard_rate_mb, or immediately after a BIO_SPEEDUP. A discard
+     * waiting on load sets discard_fg_wait and is woken by the completion
+     * that brings fg_inflight down; one waiting on the rate limit by
+     * discard_timer.
+     */
+    struct bio_queue_head       *discard_queue;
+    fusion_atomic_t              fg_inflight;
+    volatile int                 discard_fg_wait;
+    uint64_t                     discard_next_us;
+    int                          discard_speedup;
+    int                          discard_timer_armed;
+    struct fusion_timer_list     discard_timer;
+    struct bio                  *discard_deferred_bp;
+
+    uint64_t                     stat_discard_queued;
+    uint64_t                     stat_discard_issued;
+    uint64_t                     stat_discard_bytes;
+    uint64_t                     stat_discard_deferred;
+    uint64_t                     stat_discard_speedups;
+
+    /*
+     * Write holdoff: set by the core while the groomer is behind. Writes
+     * stay on bio_queue while reads and discards keep flowing.
+     */
+    int                          write_holdoff;
+    uint64_t                     holdoff_start_us;
+    uint64_t                     stat_holdoff_count;
+    uint64_t                     stat_holdoff_us;
+    uint64_t                     stat_holdoff_max_us;
+
+    /* Like the stats above, only updated under bio_lock. */
+    uint64_t                     stat_zero_writes;
+    uint64_t                     stat_zero_write_bytes;
+
+    struct sysctl_ctx_list       sysctl_ctx;
+    struct sysctl_oid           *sysctl_tree;
 };
 
 /*
@@ -273,6 +273,10 @@ void fusion_create_kthread(fusion_kthread_func_t func, void *data, void *fusion_
  */
 #define kfio_barrier()          __asm__ volatile("mfence":::"memory")
 
+/* Pointer-sized compare-and-swap and exchange, used by fio_atomic_list. */
+#define kfio_cmpxchg(ptr, old, new)   __sync_val_compare_and_swap((ptr), (old), (new))
+#define kfio_xchg(ptr, val)           __sync_lock_test_and_set((ptr), (val))
+
 #define fusion_divmod(quotient, remainder, dividend, divisor)  do { \
    quotient  = dividend / divisor;  \
    remainder = dividend % divisor; \
@@ -287,4 +291,7 @@ void fusion_create_kthread(fusion_kthread_func_t func, void *data, void *fusion_
 #define KFIO_INFO_USE_OS_BACKEND 1
 #define KFIO_SUPPORTS_DUAL_PIPE 1
 
+/* Reserved cache objects are kept by kcache.c rather than under cache->lock. */
+#define PORT_HAS_KFIO_CACHE_RESERVE 1
+
 #endif // __FUSION_FREEBSD_KTYPES_H__
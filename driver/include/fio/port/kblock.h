@@ -42,8 +42,6 @@ extern void kfio_disk_stat_read_update(struct kfio_disk *gd, uint64_t totalsize,
 extern void kfio_disk_stat_write_update(struct kfio_disk *gd, uint64_t totalsize, uint64_t duration);
 extern int  kfio_get_gd_in_flight(struct kfio_disk *gd, int rw);
 extern void kfio_set_gd_in_flight(struct kfio_disk *gd, int rw, int in_flight);
-extern void kfio_set_write_holdoff(struct kfio_disk *disk);
-extern void kfio_clear_write_holdoff(struct kfio_disk *disk);
 extern void kfio_mark_lock_pending(struct kfio_disk *disk);
 extern void kfio_unmark_lock_pending(struct kfio_disk *disk);
 #else
@@ -55,6 +53,11 @@ static inline void kfio_mark_lock_pending(void *disk) { }
 static inline void kfio_unmark_lock_pending(void *disk) { }
 #endif
 
+#if defined(__linux__) || defined(__FreeBSD__)
+extern void kfio_set_write_holdoff(struct kfio_disk *disk);
+extern void kfio_clear_write_holdoff(struct kfio_disk *disk);
+#endif
+
 /*
  * Functions implemented in OS-specific kblock code and called from
  * parts of the core that are not OS-aware.
@@ -129,6 +129,48 @@ extern void kfio_cache_free_node(fusion_mem_cache_t *cache, void *p);
 #endif
 extern void kfio_cache_destroy(fusion_mem_cache_t *cache);
 
+#if defined(PORT_HAS_KFIO_CACHE_RESERVE) && PORT_HAS_KFIO_CACHE_RESERVE
+/*
+ * The port keeps reserved objects itself (per CPU, without cache->lock);
+ * reserved_count and reserved_list are left unused.
+ */
+extern int   kfio_cache_reserve(fusion_mem_cache_t *cache, int can_wait, uint32_t n);
+extern int   kfio_cache_release(fusion_mem_cache_t *cache, uint32_t n);
+extern void *kfio_cache_prealloc(fusion_mem_cache_t *cache);
+extern void  kfio_cache_free_prealloc(fusion_mem_cache_t *cache, void *p);
+
+static inline int fusion_cache_reserve(fusion_mem_cache_t *cache, int can_wait, uint32_t n)
+{
+    return kfio_cache_reserve(cache, can_wait, n);
+}
+
+static inline int fusion_cache_release(fusion_mem_cache_t *cache, uint32_t n)
+{
+    return kfio_cache_release(cache, n);
+}
+
+static inline void *fusion_cache_prealloc(fusion_mem_cache_t *cache)
+{
+    return kfio_cache_prealloc(cache);
+}
+
+static inline void *fusion_cache_alloc(fusion_mem_cache_t *cache, int can_wait)
+{
+    return kfio_cache_alloc(cache, can_wait);
+}
+
+static inline void fusion_cache_free(fusion_mem_cache_t *cache, void *p, int prealloc)
+{
+    if (prealloc)
+    {
+        kfio_cache_free_prealloc(cache, p);
+    }
+    else
+    {
+        kfio_cache_free(cache, p);
+    }
+}
+#else
 static inline int fusion_cache_reserve(fusion_mem_cache_t *cache, int can_wait, uint32_t n)
 {
     int retval = 0;
@@ -238,6 +280,7 @@ static inline void fusion_cache_free(fusion_mem_cache_t *cache, void *p, int pre
         kfio_cache_free(cache, p);
     }
 }
+#endif
 
 static inline void fusion_cache_destroy(fusion_mem_cache_t *cache)
 {
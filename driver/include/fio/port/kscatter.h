@@ -104,6 +104,12 @@ static inline int kfio_sgl_map_user_pages(kfio_sg_list_t *sgl, fusion_user_page_
 }
 #endif
 
+#if defined(__FreeBSD__)
+/* Long-lived buffers whose DMA mapping is kept across I/Os. */
+extern int  kfio_dma_register_buffer(kfio_pci_dev_t *pcidev, void *buffer, uint32_t size);
+extern void kfio_dma_unregister_buffer(kfio_pci_dev_t *pcidev, void *buffer);
+#endif
+
 #if PORT_SUPPORTS_SGLIST_COPY
 extern int kfio_sgl_copy_data(kfio_sg_list_t *dst, kfio_sg_list_t *src, uint32_t length);
 #endif
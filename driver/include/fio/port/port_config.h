@@ -59,7 +59,7 @@
 #define STRICT_SYNC -1
 
 /* Internal */
-#define PORT_SUPPORTS_PCI_NUMA_INFO 0
+#define PORT_SUPPORTS_PCI_NUMA_INFO 1
 
 /* N/A */
 #define DISABLE_MSIX 0
@@ -218,7 +218,7 @@
 #define IODRIVE_MAKE_ASSERT_NONFATAL 0
 
 /* Internal */
-#define PORT_SUPPORTS_SGLIST_COPY 0
+#define PORT_SUPPORTS_SGLIST_COPY 1
 
 /* For use only under the direction of Customer Support. */
 #define ENABLE_DISCARD 1
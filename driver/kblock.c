@@ -34,7 +34,9 @@
 #include <sys/bio.h>
 #include <sys/conf.h>
 #include <sys/proc.h>
+#include <sys/sysctl.h>
 #include <geom/geom_disk.h>
+#include <machine/atomic.h>
 
 #include "port-internal.h"
 #include "pci_dev.h"
@@ -46,6 +48,24 @@
 
 int iodrive_barrier_sync = 1;
 
+/*
+ * Background discard tunables.
+ */
+SYSCTL_DECL(_hw_fio);
+
+static int discard_rate_mb = 0;
+TUNABLE_INT("hw.fio.discard_rate_mb", &discard_rate_mb);
+SYSCTL_INT(_hw_fio, OID_AUTO, discard_rate_mb, CTLFLAG_RW, &discard_rate_mb, 0, "Maximum rate in MiB/s at which queued discards are issued to the device (0 = unlimited).");
+static int discard_fg_depth = 4;
+TUNABLE_INT("hw.fio.discard_fg_depth", &discard_fg_depth);
+SYSCTL_INT(_hw_fio, OID_AUTO, discard_fg_depth, CTLFLAG_RW, &discard_fg_depth, 4, "Queued discards are only issued while at most this many reads and writes are in flight.");
+static int discard_max_mb = 256;
+TUNABLE_INT("hw.fio.discard_max_mb", &discard_max_mb);
+SYSCTL_INT(_hw_fio, OID_AUTO, discard_max_mb, CTLFLAG_RW, &discard_max_mb, 256, "Largest single discard in MiB accepted from GEOM, applied at device creation (0 = unlimited).");
+static int zero_write_discard = 0;
+TUNABLE_INT("hw.fio.zero_write_discard", &zero_write_discard);
+SYSCTL_INT(_hw_fio, OID_AUTO, zero_write_discard, CTLFLAG_RW, &zero_write_discard, 0, "Issue sector aligned all-zero writes as discards on devices with persistent trim (1=enable, 0=disable).");
+
 /*******************************************************************************
  */
 static int  freebsd_disk_open(struct disk *dev);
@@ -53,6 +73,65 @@ static int  freebsd_disk_close(struct disk *dev);
 static int  freebsd_disk_ioctl(struct disk *dev, u_long cmd, void *data,
                                int fflag, struct thread *td);
 static void freebsd_disk_strategy(struct bio *bp);
+static void kfio_block_discard_timer(fio_uintptr_t arg);
+
+/******************************************************************************
+ * Per-disk statistics, exported under dev.fct.<unit>.bio
+ */
+static void
+kfio_block_sysctl_init(struct kfio_disk *disk)
+{
+    struct sysctl_oid_list *children;
+
+    sysctl_ctx_init(&disk->sysctl_ctx);
+
+    disk->sysctl_tree = SYSCTL_ADD_NODE(&disk->sysctl_ctx,
+                                        SYSCTL_CHILDREN(device_get_sysctl_tree(disk->pci_dev->dev)),
+                                        OID_AUTO, "bio", CTLFLAG_RD, 0, "Block I/O statistics");
+    if (disk->sysctl_tree == NULL)
+    {
+        return;
+    }
+
+    children = SYSCTL_CHILDREN(disk->sysctl_tree);
+
+    SYSCTL_ADD_INT(&disk->sysctl_ctx, children, OID_AUTO, "fg_inflight",
+                   CTLFLAG_RD, (int *)&disk->fg_inflight, 0,
+                   "Reads and writes currently in flight");
+    SYSCTL_ADD_U64(&disk->sysctl_ctx, children, OID_AUTO, "discard_queued",
+                   CTLFLAG_RD, &disk->stat_discard_queued, 0,
+                   "Discards placed on the background queue");
+    SYSCTL_ADD_U64(&disk->sysctl_ctx, children, OID_AUTO, "discard_issued",
+                   CTLFLAG_RD, &disk->stat_discard_issued, 0,
+                   "Discards issued from the background queue");
+    SYSCTL_ADD_U64(&disk->sysctl_ctx, children, OID_AUTO, "discard_bytes",
+                   CTLFLAG_RD, &disk->stat_discard_bytes, 0,
+                   "Bytes issued from the background queue");
+    SYSCTL_ADD_U64(&disk->sysctl_ctx, children, OID_AUTO, "discard_deferred",
+                   CTLFLAG_RD, &disk->stat_discard_deferred, 0,
+                   "Queued discards that had to wait for load or rate limit");
+    SYSCTL_ADD_U64(&disk->sysctl_ctx, children, OID_AUTO, "discard_speedups",
+                   CTLFLAG_RD, &disk->stat_discard_speedups, 0,
+                   "BIO_SPEEDUP requests that forced the discard queue to drain");
+    SYSCTL_ADD_INT(&disk->sysctl_ctx, children, OID_AUTO, "write_holdoff",
+                   CTLFLAG_RD, &disk->write_holdoff, 0,
+                   "Write dispatch is currently held off");
+    SYSCTL_ADD_U64(&disk->sysctl_ctx, children, OID_AUTO, "holdoff_count",
+                   CTLFLAG_RD, &disk->stat_holdoff_count, 0,
+                   "Number of write holdoff periods");
+    SYSCTL_ADD_U64(&disk->sysctl_ctx, children, OID_AUTO, "holdoff_us",
+                   CTLFLAG_RD, &disk->stat_holdoff_us, 0,
+                   "Total time in microseconds writes were held off");
+    SYSCTL_ADD_U64(&disk->sysctl_ctx, children, OID_AUTO, "holdoff_max_us",
+                   CTLFLAG_RD, &disk->stat_holdoff_max_us, 0,
+                   "Longest single write holdoff period in microseconds");
+    SYSCTL_ADD_U64(&disk->sysctl_ctx, children, OID_AUTO, "zero_writes",
+                   CTLFLAG_RD, &disk->stat_zero_writes, 0,
+                   "All-zero writes issued as discards");
+    SYSCTL_ADD_U64(&disk->sysctl_ctx, children, OID_AUTO, "zero_write_bytes",
+                   CTLFLAG_RD, &disk->stat_zero_write_bytes, 0,
+                   "Bytes of all-zero writes elided");
+}
 
 /******************************************************************************
  * called from fio_create_blockdev()
@@ -76,9 +155,16 @@ kfio_block_create_device(kfio_pci_dev_t *pcidev, struct fio_device *dev,
 
     kfio_memset(disk, 0, sizeof(*disk));
 
+    // The core has read the card by now; give it its preallocate_memory share.
+    kfio_prealloc_device(pdev);
+
     fusion_cv_lock_init(&disk->bio_lock, "fio_bio_lk");
     fusion_condvar_init(&disk->bio_cv,   "fio_bio_cv");
 
+    fusion_init_timer(&disk->discard_timer);
+    fusion_set_timer_function(&disk->discard_timer, kfio_block_discard_timer);
+    fusion_set_timer_data(&disk->discard_timer, (fio_uintptr_t)disk);
+
     dp = disk_alloc();
 
     dp->d_flags    = DISKFLAG_CANDELETE;
@@ -91,6 +177,13 @@ kfio_block_create_device(kfio_pci_dev_t *pcidev, struct fio_device *dev,
     dp->d_unit = pdev->unit;
     dp->d_maxsize = MAXPHYS;
 
+    /*
+     * Keep individual discards small enough for the background queue
+     * to pace them.
+     */
+    if (discard_max_mb > 0)
+        dp->d_delmaxsize = (off_t)discard_max_mb << 20;
+
     dp->d_sectorsize = sector_size;
     dp->d_mediasize  = capacity;
     dp->d_fwsectors  = 63;
@@ -104,9 +197,12 @@ kfio_block_create_device(kfio_pci_dev_t *pcidev, struct fio_device *dev,
     disk->pci_dev   = pdev;
     disk->fio_dev   = dev;
     disk->bio_queue = &pdev->bioq;
+    disk->discard_queue = &pdev->discard_bioq;
 
     disk->dev_state = DEAD;
 
+    kfio_block_sysctl_init(disk);
+
     *diskp = disk;
 
     return (0);
@@ -144,6 +240,12 @@ kfio_block_destroy_device(struct kfio_disk *disk)
      * Return all incomplete requests with an error.
      */
     bioq_flush(disk->bio_queue, NULL, ENXIO);
+    bioq_flush(disk->discard_queue, NULL, ENXIO);
+
+    /*
+     * No new timer can be armed once the device is DEAD.
+     */
+    fusion_del_timer(&disk->discard_timer);
 
     /*
      * Kill the user visible device.
@@ -153,6 +255,7 @@ kfio_block_destroy_device(struct kfio_disk *disk)
     /*
      * Destroy the private disk structure.
      */
+    sysctl_ctx_free(&disk->sysctl_ctx);
     fusion_condvar_destroy(&disk->bio_cv);
     fusion_cv_lock_destroy(&disk->bio_lock);
 
@@ -165,6 +268,46 @@ kfio_block_get_device_name(struct kfio_disk *disk, char *name, size_t size)
     kfio_snprintf(name, size, "%s%d", disk->dp->d_name, disk->dp->d_unit);
 }
 
+/******************************************************************************
+ * called from the core when the groomer falls behind
+ */
+void
+kfio_set_write_holdoff(struct kfio_disk *disk)
+{
+    fusion_cv_lock(&disk->bio_lock);
+    if (!disk->write_holdoff)
+    {
+        disk->write_holdoff = 1;
+        disk->holdoff_start_us = fusion_getmicrotime();
+        disk->stat_holdoff_count++;
+    }
+    fusion_cv_unlock(&disk->bio_lock);
+}
+
+/******************************************************************************
+ * called from the core once the groomer has caught up
+ */
+void
+kfio_clear_write_holdoff(struct kfio_disk *disk)
+{
+    uint64_t elapsed;
+
+    fusion_cv_lock(&disk->bio_lock);
+    if (disk->write_holdoff)
+    {
+        disk->write_holdoff = 0;
+
+        elapsed = fusion_getmicrotime() - disk->holdoff_start_us;
+        disk->stat_holdoff_us += elapsed;
+        if (elapsed > disk->stat_holdoff_max_us)
+            disk->stat_holdoff_max_us = elapsed;
+
+        /* Let the submit thread pick up the writes we've been sitting on. */
+        fusion_condvar_broadcast(&disk->bio_cv);
+    }
+    fusion_cv_unlock(&disk->bio_lock);
+}
+
 /*******************************************************************************
  */
 static int
@@ -226,6 +369,28 @@ freebsd_disk_strategy(struct bio *bio)
     {
         biofinish(bio, NULL, ENXIO);
     }
+#ifdef BIO_SPEEDUP
+    else if (bio->bio_cmd == BIO_SPEEDUP)
+    {
+        /*
+         * Somebody is short on free space: stop pacing discards and let
+         * the submit thread drain the background queue right away.
+         */
+        if ((bio->bio_flags & BIO_SPEEDUP_TRIM) != 0)
+        {
+            fusion_cv_lock(&disk->bio_lock);
+            if (bioq_first(disk->discard_queue) != NULL)
+            {
+                disk->discard_speedup = 1;
+                disk->stat_discard_speedups++;
+                fusion_condvar_broadcast(&disk->bio_cv);
+            }
+            fusion_cv_unlock(&disk->bio_lock);
+        }
+        bio->bio_error = 0;
+        biodone(bio);
+    }
+#endif
     else if (bio->bio_bcount == 0)
     {
         bio->bio_resid = 0;
@@ -241,13 +406,241 @@ freebsd_disk_strategy(struct bio *bio)
         else
         {
             bio->bio_driver1 = bio->bio_data;
-            bioq_disksort(disk->bio_queue, bio);
+            if (bio->bio_cmd == BIO_DELETE)
+            {
+                bioq_insert_tail(disk->discard_queue, bio);
+                disk->stat_discard_queued++;
+            }
+            else
+            {
+                bioq_disksort(disk->bio_queue, bio);
+            }
             fusion_condvar_broadcast(&disk->bio_cv);
         }
         fusion_cv_unlock(&disk->bio_lock);
     }
 }
 
+/******************************************************************************
+ * Wakes up the submit thread once a deferred discard may be issued.
+ */
+static void
+kfio_block_discard_timer(fio_uintptr_t arg)
+{
+    struct kfio_disk *disk = (struct kfio_disk *)arg;
+
+    fusion_cv_lock(&disk->bio_lock);
+    disk->discard_timer_armed = 0;
+    fusion_condvar_broadcast(&disk->bio_cv);
+    fusion_cv_unlock(&disk->bio_lock);
+}
+
+/*
+ * Holds back the discard at the head of the queue. A discard waiting on
+ * the rate limit arms the timer for when it may go; one waiting on load
+ * passes ticks == 0 and is woken by freebsd_bio_completor() instead.
+ * Called with bio_lock held.
+ */
+static void
+kfio_block_discard_defer(struct kfio_disk *disk, struct bio *bp, uint64_t ticks)
+{
+    if (disk->discard_deferred_bp != bp)
+    {
+        disk->discard_deferred_bp = bp;
+        disk->stat_discard_deferred++;
+    }
+
+    if (ticks > 0 && !disk->discard_timer_armed && disk->dev_state != DEAD)
+    {
+        disk->discard_timer_armed = 1;
+        fusion_set_relative_timer(&disk->discard_timer, ticks);
+    }
+}
+
+/*
+ * Accounts a background discard once it has been handed to the core and
+ * charges it against the rate limit. Called with bio_lock held.
+ */
+static void
+kfio_block_discard_issued(struct kfio_disk *disk, struct bio *bp)
+{
+    if (disk->discard_deferred_bp == bp)
+        disk->discard_deferred_bp = NULL;
+
+    disk->stat_discard_issued++;
+    disk->stat_discard_bytes += bp->bio_bcount;
+
+    if (discard_rate_mb > 0 && !disk->discard_speedup)
+    {
+        disk->discard_next_us = fusion_getmicrotime() +
+            (uint64_t)bp->bio_bcount * 1000000ULL / ((uint64_t)discard_rate_mb << 20);
+    }
+}
+
+/*
+ * How far down the queue a held-off write lets take_bio look for a read.
+ */
+#define KFIO_HOLDOFF_SCAN 32
+
+/*
+ * Whether bp overlaps any write or discard queued ahead of it.
+ */
+static int
+kfio_block_bio_overlaps(struct kfio_disk *disk, struct bio *bp)
+{
+    struct bio *prev;
+
+    for (prev = bioq_first(disk->bio_queue); prev != bp; prev = TAILQ_NEXT(prev, bio_queue))
+    {
+        if (prev->bio_offset < bp->bio_offset + bp->bio_length &&
+            bp->bio_offset < prev->bio_offset + prev->bio_length)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns the next foreground request. While writes are held off, the
+ * first read queued behind the held writes and discards is taken instead,
+ * unless it overlaps one of them. The scan stops at any other request,
+ * such as a flush, which keeps its place along with everything behind
+ * it. Called with bio_lock held.
+ */
+static struct bio *
+kfio_block_take_bio(struct kfio_disk *disk)
+{
+    struct bio *bp;
+    int scanned;
+
+    bp = bioq_first(disk->bio_queue);
+    if (bp == NULL || !disk->write_holdoff || bp->bio_cmd != BIO_WRITE)
+    {
+        return bioq_takefirst(disk->bio_queue);
+    }
+
+    for (scanned = 0; bp != NULL && scanned < KFIO_HOLDOFF_SCAN;
+         bp = TAILQ_NEXT(bp, bio_queue), scanned++)
+    {
+        if (bp->bio_cmd == BIO_READ)
+        {
+            if (kfio_block_bio_overlaps(disk, bp))
+            {
+                break;
+            }
+            bioq_remove(disk->bio_queue, bp);
+            return bp;
+        }
+        if (bp->bio_cmd != BIO_WRITE && bp->bio_cmd != BIO_DELETE)
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns the next queued discard if foreground load and the configured
+ * rate allow one to be issued now. Called with bio_lock held.
+ */
+static struct bio *
+kfio_block_take_discard(struct kfio_disk *disk)
+{
+    struct bio *bp;
+    uint64_t    now;
+
+    bp = bioq_first(disk->discard_queue);
+    if (bp == NULL)
+    {
+        disk->discard_speedup = 0;
+        return NULL;
+    }
+
+    if (!disk->discard_speedup)
+    {
+        /*
+         * Publish that we are waiting before looking at the load, so a
+         * completion racing with us either sees the flag or leaves a
+         * load we can proceed under.
+         */
+        disk->discard_fg_wait = 1;
+        atomic_thread_fence_seq_cst();
+
+        if (fusion_atomic_read(&disk->fg_inflight) > discard_fg_depth)
+        {
+            kfio_block_discard_defer(disk, bp, 0);
+            return NULL;
+        }
+        disk->discard_fg_wait = 0;
+
+        if (discard_rate_mb > 0)
+        {
+            now = fusion_getmicrotime();
+
+            if (now < disk->discard_next_us)
+            {
+                kfio_block_discard_defer(disk, bp,
+                                         MAX(fusion_usectohz(disk->discard_next_us - now), 1));
+                return NULL;
+            }
+        }
+    }
+
+    bioq_remove(disk->discard_queue, bp);
+
+    return bp;
+}
+
+/*
+ * Returns non-zero if the buffer holds nothing but zeroes. Eight words are
+ * OR-ed together per pass so the common non-zero case bails out within
+ * the first cache line. buf must be 8 byte aligned.
+ */
+static int
+kfio_buffer_is_zero(const void *buf, size_t len)
+{
+    const uint64_t *wp = buf;
+    const uint8_t  *bp;
+    size_t          n;
+
+    for (n = len / 64; n > 0; n--, wp += 8)
+    {
+        if ((wp[0] | wp[1] | wp[2] | wp[3] | wp[4] | wp[5] | wp[6] | wp[7]) != 0)
+            return 0;
+    }
+
+    for (bp = (const uint8_t *)wp, n = len % 64; n > 0; n--, bp++)
+    {
+        if (*bp != 0)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * A zero write may only be turned into a discard if the device reads back
+ * zeroes for trimmed sectors even across a power cut, which is what
+ * persistent trim guarantees.
+ */
+static int
+kfio_block_write_is_zero(struct kfio_disk *disk, struct bio *bp)
+{
+    uint32_t sector_size = disk->dp->d_sectorsize;
+
+    if (!zero_write_discard || !enable_discard)
+        return 0;
+
+    if (((uint64_t)bp->bio_offset % sector_size) != 0 ||
+        ((uint64_t)bp->bio_bcount % sector_size) != 0)
+        return 0;
+
+    if (!fio_device_ptrim_available(disk->fio_dev))
+        return 0;
+
+    return kfio_buffer_is_zero(bp->bio_data, bp->bio_bcount);
+}
+
 static void
 freebsd_bio_completor(kfio_bio_t *fbio, uint64_t bytes_done, int error)
 {
@@ -258,7 +651,19 @@ freebsd_bio_completor(kfio_bio_t *fbio, uint64_t bytes_done, int error)
      */
     if (fbio->fbio_cmd == KBIO_CMD_READ || fbio->fbio_cmd == KBIO_CMD_WRITE)
     {
+        struct kfio_disk *disk = bp->bio_disk->d_drv1;
+
         kfio_sgl_dma_unmap(fbio->fbio_sgl);
+
+        if (fusion_atomic_decr(&disk->fg_inflight) <= discard_fg_depth &&
+            disk->discard_fg_wait)
+        {
+            /* Foreground load is down far enough for a held back discard. */
+            fusion_cv_lock(&disk->bio_lock);
+            disk->discard_fg_wait = 0;
+            fusion_condvar_broadcast(&disk->bio_cv);
+            fusion_cv_unlock(&disk->bio_lock);
+        }
     }
 
     /*
@@ -292,12 +697,17 @@ kfio_block_dequeue_bio(struct kfio_disk *disk)
     dp = disk->dp;
 
     /*
-     * Try to get next bio request to proceed.
+     * Try to get next bio request to proceed. Foreground requests always
+     * go first; discards are only picked up when there is nothing else.
      */
-    bp = bioq_takefirst(disk->bio_queue);
+    bp = kfio_block_take_bio(disk);
     if (bp == NULL)
     {
-        return NULL;
+        bp = kfio_block_take_discard(disk);
+        if (bp == NULL)
+        {
+            return NULL;
+        }
     }
 
     fusion_cv_unlock(&disk->bio_lock);
@@ -352,6 +762,10 @@ kfio_block_dequeue_bio(struct kfio_disk *disk)
     {
         fbio->fbio_cmd = KBIO_CMD_DISCARD;
 
+        fusion_cv_lock(&disk->bio_lock);
+        kfio_block_discard_issued(disk, bp);
+        fusion_cv_unlock(&disk->bio_lock);
+
         return fbio;
     }
     else
@@ -359,6 +773,16 @@ kfio_block_dequeue_bio(struct kfio_disk *disk)
     {
         if (bp->bio_cmd == BIO_WRITE)
         {
+            if (kfio_block_write_is_zero(disk, bp))
+            {
+                fusion_cv_lock(&disk->bio_lock);
+                disk->stat_zero_writes++;
+                disk->stat_zero_write_bytes += bp->bio_bcount;
+                fusion_cv_unlock(&disk->bio_lock);
+
+                fbio->fbio_cmd = KBIO_CMD_DISCARD;
+                return fbio;
+            }
             fbio->fbio_cmd = KBIO_CMD_WRITE;
         }
         else if (bp->bio_cmd == BIO_READ)
@@ -382,6 +806,7 @@ kfio_block_dequeue_bio(struct kfio_disk *disk)
             {
                 kassert(fbio->fbio_size == kfio_sgl_size(fbio->fbio_sgl));
 
+                fusion_atomic_inc(&disk->fg_inflight);
                 return fbio;
             }
         }
@@ -414,7 +839,10 @@ error_exit:
     else
     {
         fusion_cv_lock(&disk->bio_lock);
-        bioq_insert_head(disk->bio_queue, bp);
+        if (bp->bio_cmd == BIO_DELETE)
+            bioq_insert_head(disk->discard_queue, bp);
+        else
+            bioq_insert_head(disk->bio_queue, bp);
     }
     return NULL;
 }
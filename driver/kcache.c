@@ -31,10 +31,234 @@
 #endif
 
 #include "port-internal.h"
+#include <sys/counter.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
 #include <sys/queue.h>
+#include <sys/smp.h>
+#include <sys/sysctl.h>
 #include <vm/uma.h>
 
 #include <fio/port/dbgset.h>
+#include <fio/port/atomic_list.h>
+
+/*
+ * fusion_mem_cache_t is laid out by the core, so everything the port keeps
+ * per cache lives in this structure and fusion_mem_cache_t.p points to it.
+ *
+ * Caches named in hw.fio.cache_magazines get a per-CPU magazine in front
+ * of their zone: a small stack of free objects touched only by its own CPU
+ * inside a critical section, so the I/O path allocates and frees request
+ * structures without touching the zone at all. Caches named in
+ * hw.fio.cache_nozero hand out objects without clearing them, for callers
+ * that initialise every field themselves. Caches named in
+ * hw.fio.cache_align_cache have every object start on its own cache line,
+ * so objects completed on different CPUs never share one.
+ *
+ * Objects set aside by fusion_cache_reserve() sit on per-CPU lock-free
+ * stacks rather than on cache->reserved_list under cache->lock. Only the
+ * owning CPU pops a single entry, and it does so inside a critical section;
+ * everyone else can only push, or take a whole stack at once with an
+ * exchange. Since an entry can only come back to the head of a stack by a
+ * push from the owning CPU, which cannot run while the pop is in progress,
+ * the pop's compare-and-swap is not exposed to ABA. A CPU that runs dry
+ * refills from a mutex protected depot, which in turn steals other CPUs'
+ * stacks when it is empty.
+ */
+#define KFIO_MAGAZINE_MAX 64
+
+struct kfio_magazine
+{
+    int   count;
+    void *objs[KFIO_MAGAZINE_MAX];
+} __aligned(CACHE_LINE_SIZE);
+
+struct kfio_reserve_stack
+{
+    struct fio_atomic_list head;
+} __aligned(CACHE_LINE_SIZE);
+
+struct kfio_cache
+{
+    LIST_ENTRY(kfio_cache) link;        /* on cache_list */
+    char                   name[40];
+    uma_zone_t             zone;
+    uint32_t               size;
+    uint32_t               align;       /* effective object alignment */
+    int                    nozero;
+    int                    mag_depth;
+    struct kfio_magazine  *mags;
+    counter_u64_t          mag_hits;
+    counter_u64_t          mag_misses;
+    struct kfio_reserve_stack *rsv;     /* per-CPU reserved objects */
+    struct mtx             rsv_lock;    /* protects rsv_depot */
+    struct fio_atomic_list rsv_depot;
+    u_int                  rsv_count;   /* reserved and not yet released */
+    counter_u64_t          rsv_local;
+    counter_u64_t          rsv_depot_hits;
+    counter_u64_t          rsv_steals;
+    counter_u64_t          rsv_empty;
+    struct kfio_mem_acct   acct;        /* objects handed out */
+    int                    reserve;     /* UMA reserve set aside for preallocation */
+    int                    prealloc;    /* objects preallocated for attached devices */
+    struct sysctl_ctx_list sysctl_ctx;
+};
+
+static LIST_HEAD(, kfio_cache) cache_list = LIST_HEAD_INITIALIZER(cache_list);
+static struct mtx cache_list_lock;
+MTX_SYSINIT(fio_cache_list, &cache_list_lock, "fio_cache_list", MTX_DEF);
+
+SYSCTL_DECL(_hw_fio);
+static SYSCTL_NODE(_hw_fio, OID_AUTO, cache, CTLFLAG_RD, 0, "fio memory caches");
+
+static char cache_magazines[256] = "iodrive_request";
+TUNABLE_STR("hw.fio.cache_magazines", cache_magazines, sizeof(cache_magazines));
+SYSCTL_STRING(_hw_fio, OID_AUTO, cache_magazines, CTLFLAG_RD, cache_magazines,
+              sizeof(cache_magazines), "Caches given per-CPU magazines (comma separated list of cache names)");
+static int cache_magazine_depth = 32;
+TUNABLE_INT("hw.fio.cache_magazine_depth", &cache_magazine_depth);
+SYSCTL_INT(_hw_fio, OID_AUTO, cache_magazine_depth, CTLFLAG_RD, &cache_magazine_depth, 32, "Objects kept per CPU in each cache magazine (0=disable magazines).");
+static char cache_nozero[256] = "";
+TUNABLE_STR("hw.fio.cache_nozero", cache_nozero, sizeof(cache_nozero));
+SYSCTL_STRING(_hw_fio, OID_AUTO, cache_nozero, CTLFLAG_RD, cache_nozero,
+              sizeof(cache_nozero), "Caches whose objects are not zeroed on allocation (comma separated list of cache names)");
+static char cache_align_cache[256] = "iodrive_request";
+TUNABLE_STR("hw.fio.cache_align_cache", cache_align_cache, sizeof(cache_align_cache));
+SYSCTL_STRING(_hw_fio, OID_AUTO, cache_align_cache, CTLFLAG_RD, cache_align_cache,
+              sizeof(cache_align_cache), "Caches whose objects are cache line aligned (comma separated list of cache names)");
+static char preallocate_caches[256] = "iodrive_request,fusion_ioctx";
+TUNABLE_STR("hw.fio.preallocate_caches", preallocate_caches, sizeof(preallocate_caches));
+SYSCTL_STRING(_hw_fio, OID_AUTO, preallocate_caches, CTLFLAG_RD, preallocate_caches,
+              sizeof(preallocate_caches), "Caches warmed for devices attached with preallocate_memory (comma separated list of cache names)");
+
+/*
+ * Returns non-zero if name appears in the comma separated list.
+ */
+int kfio_name_listed(const char *list, const char *name)
+{
+    size_t len = strlen(name);
+    const char *p;
+
+    for (p = list; *p != '\0'; )
+    {
+        const char *end = strchr(p, ',');
+        size_t n = end != NULL ? (size_t)(end - p) : strlen(p);
+
+        if (n == len && strncmp(p, name, len) == 0)
+        {
+            return 1;
+        }
+        if (end == NULL)
+        {
+            break;
+        }
+        p = end + 1;
+    }
+    return 0;
+}
+
+/*
+ * Objects in use beyond what was preallocated, i.e. served by growing the
+ * zone rather than from the preallocated slabs.
+ */
+static int kfio_cache_overflow_handler(SYSCTL_HANDLER_ARGS)
+{
+    struct kfio_cache *kc = arg1;
+    int val = 0;
+
+    if (kc->prealloc > 0)
+    {
+        val = MAX(uma_zone_get_cur(kc->zone) - kc->prealloc, 0);
+    }
+    return sysctl_handle_int(oidp, &val, 0, req);
+}
+
+static void kfio_cache_sysctl_init(struct kfio_cache *kc, const char *name)
+{
+    struct sysctl_oid *oid;
+
+    sysctl_ctx_init(&kc->sysctl_ctx);
+
+    oid = SYSCTL_ADD_NODE(&kc->sysctl_ctx, SYSCTL_STATIC_CHILDREN(_hw_fio_cache), OID_AUTO,
+                          name, CTLFLAG_RD, 0, "memory cache");
+    if (oid == NULL)
+    {
+        return;
+    }
+
+    SYSCTL_ADD_UINT(&kc->sysctl_ctx, SYSCTL_CHILDREN(oid), OID_AUTO, "size",
+                    CTLFLAG_RD, &kc->size, 0, "Object size");
+    SYSCTL_ADD_UINT(&kc->sysctl_ctx, SYSCTL_CHILDREN(oid), OID_AUTO, "align",
+                    CTLFLAG_RD, &kc->align, 0, "Object alignment");
+    SYSCTL_ADD_INT(&kc->sysctl_ctx, SYSCTL_CHILDREN(oid), OID_AUTO, "nozero",
+                   CTLFLAG_RD, &kc->nozero, 0, "Objects are not zeroed on allocation");
+    SYSCTL_ADD_INT(&kc->sysctl_ctx, SYSCTL_CHILDREN(oid), OID_AUTO, "mag_depth",
+                   CTLFLAG_RD, &kc->mag_depth, 0, "Objects kept per CPU magazine");
+
+    if (kc->mags != NULL)
+    {
+        SYSCTL_ADD_COUNTER_U64(&kc->sysctl_ctx, SYSCTL_CHILDREN(oid), OID_AUTO, "mag_hits",
+                               CTLFLAG_RD, &kc->mag_hits, "Allocations served from a magazine");
+        SYSCTL_ADD_COUNTER_U64(&kc->sysctl_ctx, SYSCTL_CHILDREN(oid), OID_AUTO, "mag_misses",
+                               CTLFLAG_RD, &kc->mag_misses, "Allocations that went to the zone");
+    }
+
+    SYSCTL_ADD_UINT(&kc->sysctl_ctx, SYSCTL_CHILDREN(oid), OID_AUTO, "reserved",
+                    CTLFLAG_RD, &kc->rsv_count, 0, "Objects held in reserve");
+    SYSCTL_ADD_COUNTER_U64(&kc->sysctl_ctx, SYSCTL_CHILDREN(oid), OID_AUTO, "reserve_local",
+                           CTLFLAG_RD, &kc->rsv_local, "Reserved objects taken from this CPU's stack");
+    SYSCTL_ADD_COUNTER_U64(&kc->sysctl_ctx, SYSCTL_CHILDREN(oid), OID_AUTO, "reserve_depot",
+                           CTLFLAG_RD, &kc->rsv_depot_hits, "Reserved objects taken from the depot");
+    SYSCTL_ADD_COUNTER_U64(&kc->sysctl_ctx, SYSCTL_CHILDREN(oid), OID_AUTO, "reserve_steals",
+                           CTLFLAG_RD, &kc->rsv_steals, "Other CPUs' stacks moved to the depot");
+    SYSCTL_ADD_COUNTER_U64(&kc->sysctl_ctx, SYSCTL_CHILDREN(oid), OID_AUTO, "reserve_empty",
+                           CTLFLAG_RD, &kc->rsv_empty, "Reserved allocations that found nothing");
+
+    kfio_mem_acct_sysctl(&kc->acct, &kc->sysctl_ctx, oid);
+
+    SYSCTL_ADD_INT(&kc->sysctl_ctx, SYSCTL_CHILDREN(oid), OID_AUTO, "prealloc",
+                   CTLFLAG_RD, &kc->prealloc, 0, "Objects preallocated for attached devices");
+    SYSCTL_ADD_PROC(&kc->sysctl_ctx, SYSCTL_CHILDREN(oid), OID_AUTO, "prealloc_overflow",
+                    CTLTYPE_INT | CTLFLAG_RD | CTLFLAG_MPSAFE, kc, 0,
+                    kfio_cache_overflow_handler, "I", "Objects in use beyond the preallocated count");
+}
+
+/*
+ * Preallocates up to count objects in each cache named in
+ * hw.fio.preallocate_caches, as far as budget bytes and the zone's reserve
+ * allow. Returns the bytes used.
+ */
+fio_size_t kfio_cache_warm(int count, fio_size_t budget)
+{
+    struct kfio_cache *kc;
+    fio_size_t used = 0;
+    int n;
+
+    mtx_lock(&cache_list_lock);
+    LIST_FOREACH(kc, &cache_list, link)
+    {
+        if (kc->reserve == 0)
+        {
+            continue;
+        }
+        n = MIN(count, kc->reserve - kc->prealloc);
+        n = MIN(n, (budget - used) / kc->size);
+        if (n <= 0)
+        {
+            continue;
+        }
+        kc->prealloc += n;
+        used += (fio_size_t)n * kc->size;
+
+        // uma_prealloc() sleeps; caches are only destroyed at unload.
+        mtx_unlock(&cache_list_lock);
+        uma_prealloc(kc->zone, n);
+        mtx_lock(&cache_list_lock);
+    }
+    mtx_unlock(&cache_list_lock);
+
+    return used;
+}
 
 /**
  * fusion_create_cache(c,t) :
@@ -43,39 +267,188 @@
 int noinline __kfio_create_cache(fusion_mem_cache_t *pcache, char *name,
                                  uint32_t size, uint32_t align)
 {
+    struct kfio_cache *kc;
+    int uma_align;
+
     dbgprint(DBGS_GENERAL, "Creating cache %s size: %d align: %d\n",
              name, size, align);
 
     strncpy(pcache->name, name, sizeof(pcache->name) - 1);
     pcache->name[sizeof(pcache->name)-1] = '\x0';
 
-    pcache->p = uma_zcreate(pcache->name, size, NULL, NULL, NULL, NULL,
-                            UMA_ALIGN_PTR, UMA_ZONE_ZINIT);
+    kc = kfio_malloc(sizeof(*kc));
+    if (NULL == kc)
+    {
+        return (-ENOMEM);
+    }
+    kfio_memset(kc, 0, sizeof(*kc));
+
+    kc->size   = size;
+    kc->nozero = kfio_name_listed(cache_nozero, pcache->name);
+
+    // UMA takes the alignment as a mask; never go below pointer alignment.
+    kc->align = MAX(align, sizeof(void *));
+    if (kfio_name_listed(cache_align_cache, pcache->name))
+    {
+        kc->align = MAX(kc->align, CACHE_LINE_SIZE);
+    }
+    uma_align = kc->align == CACHE_LINE_SIZE ? UMA_ALIGN_CACHE : (int)kc->align - 1;
 
-    if (NULL == pcache->p)
+    kc->zone = uma_zcreate(pcache->name, size, NULL, NULL, NULL, NULL,
+                           uma_align, kc->nozero ? 0 : UMA_ZONE_ZINIT);
+    if (NULL == kc->zone)
     {
+        kfio_free(kc, sizeof(*kc));
         return (-ENOMEM);
     }
+
+    /*
+     * Set the reserve while the keg is still empty. Reserved items are
+     * only handed to M_USE_RESERVE allocations, which all of this cache's
+     * are, and are left alone when the zone is drained, so what
+     * kfio_cache_warm() puts there stays put under memory pressure.
+     */
+    if (kfio_name_listed(preallocate_caches, pcache->name))
+    {
+        kc->reserve = kfio_prealloc_reserve(max_requests, size);
+        if (kc->reserve > 0)
+        {
+            uma_zone_reserve(kc->zone, kc->reserve);
+        }
+    }
+
+    if (cache_magazine_depth > 0 && kfio_name_listed(cache_magazines, pcache->name))
+    {
+        kc->mag_depth  = MIN(cache_magazine_depth, KFIO_MAGAZINE_MAX);
+        kc->mags       = kfio_malloc((mp_maxid + 1) * sizeof(struct kfio_magazine));
+        if (kc->mags != NULL)
+        {
+            kfio_memset(kc->mags, 0, (mp_maxid + 1) * sizeof(struct kfio_magazine));
+            kc->mag_hits   = counter_u64_alloc(M_WAITOK);
+            kc->mag_misses = counter_u64_alloc(M_WAITOK);
+        }
+        else
+        {
+            kc->mag_depth = 0;
+        }
+    }
+
+    kc->rsv = kfio_malloc((mp_maxid + 1) * sizeof(struct kfio_reserve_stack));
+    if (NULL == kc->rsv)
+    {
+        if (kc->mags != NULL)
+        {
+            kfio_free(kc->mags, (mp_maxid + 1) * sizeof(struct kfio_magazine));
+            counter_u64_free(kc->mag_hits);
+            counter_u64_free(kc->mag_misses);
+        }
+        uma_zdestroy(kc->zone);
+        kfio_free(kc, sizeof(*kc));
+        return (-ENOMEM);
+    }
+    kfio_memset(kc->rsv, 0, (mp_maxid + 1) * sizeof(struct kfio_reserve_stack));
+    mtx_init(&kc->rsv_lock, "fio cache reserve", NULL, MTX_DEF);
+    fusion_atomic_list_init(&kc->rsv_depot);
+    kc->rsv_local      = counter_u64_alloc(M_WAITOK);
+    kc->rsv_depot_hits = counter_u64_alloc(M_WAITOK);
+    kc->rsv_steals     = counter_u64_alloc(M_WAITOK);
+    kc->rsv_empty      = counter_u64_alloc(M_WAITOK);
+    kfio_mem_acct_init(&kc->acct);
+
+    kfio_cache_sysctl_init(kc, pcache->name);
+
+    strlcpy(kc->name, pcache->name, sizeof(kc->name));
+    mtx_lock(&cache_list_lock);
+    LIST_INSERT_HEAD(&cache_list, kc, link);
+    mtx_unlock(&cache_list_lock);
+
+    pcache->p = kc;
     return (0);
 }
 
+/*
+ * Pops an object from this CPU's magazine, or returns NULL.
+ */
+static inline void *kfio_cache_mag_get(struct kfio_cache *kc)
+{
+    struct kfio_magazine *mag;
+    void *obj = NULL;
+
+    critical_enter();
+    mag = &kc->mags[curcpu];
+    if (mag->count > 0)
+    {
+        obj = mag->objs[--mag->count];
+    }
+    critical_exit();
+
+    counter_u64_add(obj != NULL ? kc->mag_hits : kc->mag_misses, 1);
+    return obj;
+}
+
+static void *kfio_cache_zalloc(struct kfio_cache *kc, int can_wait, int domain)
+{
+    void *obj;
+    int flags;
+
+    FUSION_ALLOCATION_TRIPWIRE_TEST();
+
+    if (kc->mags != NULL && (obj = kfio_cache_mag_get(kc)) != NULL)
+    {
+        if (!kc->nozero)
+        {
+            kfio_memset(obj, 0, kc->size);
+        }
+        kfio_mem_acct_add(&kc->acct, kc->size, 1);
+        return obj;
+    }
+
+    // Never sleep where the thread may not, whatever the caller asked for.
+    flags = (can_wait && THREAD_CAN_SLEEP() && curthread->td_critnest == 0) ? M_WAITOK : M_NOWAIT;
+    if (!kc->nozero)
+    {
+        flags |= M_ZERO;
+    }
+    if (kc->reserve > 0)
+    {
+        flags |= M_USE_RESERVE;
+    }
+
+    if (domain >= 0)
+    {
+        obj = uma_zalloc_domain(kc->zone, NULL, domain, flags);
+    }
+    else
+    {
+        obj = uma_zalloc(kc->zone, flags);
+    }
+    if (obj != NULL)
+    {
+        kfio_mem_acct_add(&kc->acct, kc->size, 1);
+    }
+    return obj;
+}
+
 /**
  * @brief allocate a chunk from the given cache, possibly sleeping
  * but never doing file IO.
  *
  * This function checks if it is in interrupt context and if so will never sleep.
- * In non-interrupt context it may sleep.
+ * In non-interrupt context it may sleep if can_wait is set.
  */
 void *kfio_cache_alloc(fusion_mem_cache_t *cache, int can_wait)
 {
-    FUSION_ALLOCATION_TRIPWIRE_TEST();
-    return uma_zalloc((uma_zone_t) (cache->p), M_ZERO | M_NOWAIT/*M_WAITOK*/ );
+    return kfio_cache_zalloc(cache->p, can_wait, -1);
 }
 
+/*
+ * Magazines are per CPU rather than per node; an object recycled through
+ * one was freed on this CPU and is as local as the node's zone would give.
+ */
 void *kfio_cache_alloc_node(fusion_mem_cache_t *cache, int can_wait,
                             kfio_numa_node_t node)
 {
-    return kfio_cache_alloc(cache, can_wait);
+    return kfio_cache_zalloc(cache->p, can_wait, kfio_numa_domain(node));
 }
 
 /**
@@ -83,14 +456,243 @@ void *kfio_cache_alloc_node(fusion_mem_cache_t *cache, int can_wait,
  */
 void kfio_cache_free(fusion_mem_cache_t *cache, void *p)
 {
-    uma_zfree((uma_zone_t) (cache->p), p);
+    struct kfio_cache *kc = cache->p;
+    struct kfio_magazine *mag;
+
+    kfio_mem_acct_add(&kc->acct, -(long)kc->size, -1);
+
+    if (kc->mags != NULL)
+    {
+        critical_enter();
+        mag = &kc->mags[curcpu];
+        if (mag->count < kc->mag_depth)
+        {
+            mag->objs[mag->count++] = p;
+            p = NULL;
+        }
+        critical_exit();
+
+        if (p == NULL)
+        {
+            return;
+        }
+    }
+    uma_zfree(kc->zone, p);
+}
+/*
+ * Moves every CPU's reserve stack onto the depot. Called with rsv_lock held.
+ * Returns non-zero if anything was moved.
+ */
+static int kfio_cache_rsv_steal(struct kfio_cache *kc)
+{
+    struct fio_atomic_list chain, *last;
+    int moved = 0;
+    u_int cpu;
+
+    mtx_assert(&kc->rsv_lock, MA_OWNED);
+
+    CPU_FOREACH(cpu)
+    {
+        fusion_atomic_list_splice(&kc->rsv[cpu].head, &chain);
+        if (chain.next == NULL)
+        {
+            continue;
+        }
+        for (last = chain.next; last->next != NULL; last = last->next)
+            ;
+        last->next = kc->rsv_depot.next;
+        kc->rsv_depot.next = chain.next;
+        counter_u64_add(kc->rsv_steals, 1);
+        moved = 1;
+    }
+    return moved;
+}
+
+/*
+ * Pops one entry off the depot, stealing first if it is empty. Called with
+ * rsv_lock held.
+ */
+static struct fio_atomic_list *kfio_cache_rsv_depot_get(struct kfio_cache *kc)
+{
+    struct fio_atomic_list *obj;
+
+    mtx_assert(&kc->rsv_lock, MA_OWNED);
+
+    if (fusion_atomic_list_empty(&kc->rsv_depot) && !kfio_cache_rsv_steal(kc))
+    {
+        return NULL;
+    }
+    obj = kc->rsv_depot.next;
+    kc->rsv_depot.next = obj->next;
+    return obj;
 }
+
+/**
+ * @brief set aside n objects for later fusion_cache_prealloc() calls.
+ */
+int kfio_cache_reserve(fusion_mem_cache_t *cache, int can_wait, uint32_t n)
+{
+    struct kfio_cache *kc = cache->p;
+    struct fio_atomic_list chain, *last = NULL, *obj;
+    uint32_t i;
+
+    fusion_atomic_list_init(&chain);
+
+    for (i = 0; i < n; i++)
+    {
+        obj = kfio_cache_alloc(cache, can_wait);
+        if (NULL == obj)
+        {
+            while ((obj = chain.next) != NULL)
+            {
+                chain.next = obj->next;
+                kfio_cache_free(cache, obj);
+            }
+            return -ENOMEM;
+        }
+        obj->next = chain.next;
+        chain.next = obj;
+        if (NULL == last)
+        {
+            last = obj;
+        }
+    }
+
+    if (last != NULL)
+    {
+        mtx_lock(&kc->rsv_lock);
+        last->next = kc->rsv_depot.next;
+        kc->rsv_depot.next = chain.next;
+        mtx_unlock(&kc->rsv_lock);
+
+        atomic_add_int(&kc->rsv_count, n);
+    }
+    return 0;
+}
+
+/**
+ * @brief give n reserved objects back to the cache.
+ *
+ * Returns -ENOMEM if fewer than n are currently sitting in reserve; the ones
+ * that were are released regardless.
+ */
+int kfio_cache_release(fusion_mem_cache_t *cache, uint32_t n)
+{
+    struct kfio_cache *kc = cache->p;
+    struct fio_atomic_list *obj;
+    uint32_t i;
+    int retval = 0;
+
+    mtx_lock(&kc->rsv_lock);
+    for (i = 0; i < n; i++)
+    {
+        obj = kfio_cache_rsv_depot_get(kc);
+        if (NULL == obj)
+        {
+            retval = -ENOMEM;
+            break;
+        }
+        kfio_cache_free(cache, obj);
+    }
+    mtx_unlock(&kc->rsv_lock);
+
+    atomic_subtract_int(&kc->rsv_count, i);
+    return retval;
+}
+
+/**
+ * @brief take a reserved object, or NULL if the reserve is exhausted.
+ */
+void *kfio_cache_prealloc(fusion_mem_cache_t *cache)
+{
+    struct kfio_cache *kc = cache->p;
+    struct fio_atomic_list *head, *obj;
+
+    critical_enter();
+    head = &kc->rsv[curcpu].head;
+    do
+    {
+        obj = head->next;
+        if (NULL == obj)
+        {
+            break;
+        }
+    } while (kfio_cmpxchg(&head->next, obj, obj->next) != obj);
+    critical_exit();
+
+    if (obj != NULL)
+    {
+        counter_u64_add(kc->rsv_local, 1);
+        return obj;
+    }
+
+    mtx_lock(&kc->rsv_lock);
+    obj = kfio_cache_rsv_depot_get(kc);
+    mtx_unlock(&kc->rsv_lock);
+
+    counter_u64_add(obj != NULL ? kc->rsv_depot_hits : kc->rsv_empty, 1);
+    return obj;
+}
+
+/**
+ * @brief return an object obtained from kfio_cache_prealloc() to the reserve.
+ */
+void kfio_cache_free_prealloc(fusion_mem_cache_t *cache, void *p)
+{
+    struct kfio_cache *kc = cache->p;
+
+    critical_enter();
+    fusion_atomic_list_add((struct fio_atomic_list *)p, &kc->rsv[curcpu].head);
+    critical_exit();
+}
+
 /**
  *
  */
 void kfio_cache_destroy(fusion_mem_cache_t *cache)
 {
-    uma_zdestroy((uma_zone_t) (cache->p));
+    struct kfio_cache *kc = cache->p;
+    struct fio_atomic_list *obj;
+    u_int cpu;
+
+    mtx_lock(&cache_list_lock);
+    LIST_REMOVE(kc, link);
+    mtx_unlock(&cache_list_lock);
+
+    sysctl_ctx_free(&kc->sysctl_ctx);
+
+    if (kc->mags != NULL)
+    {
+        CPU_FOREACH(cpu)
+        {
+            while (kc->mags[cpu].count > 0)
+            {
+                uma_zfree(kc->zone, kc->mags[cpu].objs[--kc->mags[cpu].count]);
+            }
+        }
+        kfio_free(kc->mags, (mp_maxid + 1) * sizeof(struct kfio_magazine));
+        counter_u64_free(kc->mag_hits);
+        counter_u64_free(kc->mag_misses);
+    }
+
+    // Anything still reserved goes straight back to the zone.
+    mtx_lock(&kc->rsv_lock);
+    kfio_cache_rsv_steal(kc);
+    while ((obj = kc->rsv_depot.next) != NULL)
+    {
+        kc->rsv_depot.next = obj->next;
+        uma_zfree(kc->zone, obj);
+    }
+    mtx_unlock(&kc->rsv_lock);
+    mtx_destroy(&kc->rsv_lock);
+    kfio_free(kc->rsv, (mp_maxid + 1) * sizeof(struct kfio_reserve_stack));
+    counter_u64_free(kc->rsv_local);
+    counter_u64_free(kc->rsv_depot_hits);
+    counter_u64_free(kc->rsv_steals);
+    counter_u64_free(kc->rsv_empty);
+    kfio_mem_acct_fini(&kc->acct);
+
+    uma_zdestroy(kc->zone);
+    kfio_free(kc, sizeof(*kc));
     cache->p = NULL;
 }
-
@@ -0,0 +1,305 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2006-2014, Fusion-io, Inc.(acquired by SanDisk Corp. 2014)
+// Copyright (c) 2014-2015, SanDisk Corp. and/or all its affiliates. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+// * Neither the name of the SanDisk Corp. nor the names of its contributors
+//   may be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED.
+// IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//-----------------------------------------------------------------------------
+
+#if !defined (__FreeBSD__)
+#error This file supports FreeBSD only
+#endif
+
+#include "port-internal.h"
+#include <sys/bitstring.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/sx.h>
+#include <sys/sysctl.h>
+#include <vm/vm.h>
+#include <vm/vm_extern.h>
+
+#include <fio/port/dbgset.h>
+
+/*
+ * Page allocator behind kfio_alloc_0_page(). fio_chunk_init() grabs the
+ * requested number of megabytes as physically contiguous, superpage sized
+ * and aligned regions, and pages are handed out of them with a free bitmap
+ * per region. The core's metadata pages then come out of a few large
+ * mappings instead of being scattered across the kernel map one malloc at a
+ * time. Once the regions are used up, callers fall back to malloc(9).
+ * Calling fio_chunk_init() again adds regions to the pool; the table is
+ * swapped for a larger one under chunk_lock.
+ */
+#define KFIO_CHUNK_REGION_SIZE   (2 * 1024 * 1024)
+#define KFIO_CHUNK_REGION_PAGES  (KFIO_CHUNK_REGION_SIZE / PAGE_SIZE)
+
+struct kfio_chunk_region
+{
+    char     *vaddr;
+    int       nfree;
+    bitstr_t  bit_decl(used, KFIO_CHUNK_REGION_PAGES);
+};
+
+static struct kfio_chunk_region *chunk_regions;  /* sorted by vaddr */
+static int chunk_nregions;
+static int chunk_regions_size;                   /* entries allocated in chunk_regions */
+static int chunk_hint;                           /* region last allocated from */
+static int chunk_pages_total;
+static int chunk_pages_free;
+static u_long chunk_page_misses;
+static struct mtx chunk_lock;
+MTX_SYSINIT(fio_chunk, &chunk_lock, "fio_chunk", MTX_DEF);
+static struct sx chunk_grow_lock;                /* serialises init and deinit */
+SX_SYSINIT(fio_chunk_grow, &chunk_grow_lock, "fio_chunk_grow");
+
+SYSCTL_DECL(_hw_fio);
+SYSCTL_INT(_hw_fio, OID_AUTO, chunk_pages_total, CTLFLAG_RD, &chunk_pages_total, 0, "Pages held by the chunk page allocator");
+SYSCTL_INT(_hw_fio, OID_AUTO, chunk_pages_free, CTLFLAG_RD, &chunk_pages_free, 0, "Chunk allocator pages not handed out");
+SYSCTL_ULONG(_hw_fio, OID_AUTO, chunk_page_misses, CTLFLAG_RD, &chunk_page_misses, 0, "Page allocations that found the chunk allocator empty");
+
+static int kfio_chunk_region_cmp(const void *a, const void *b)
+{
+    const struct kfio_chunk_region *ra = a, *rb = b;
+
+    return ra->vaddr < rb->vaddr ? -1 : ra->vaddr > rb->vaddr;
+}
+
+/**
+ * @brief adds chunk_size_mb megabytes to the pool behind fio_chunk_alloc_page().
+ *
+ * Zero does nothing. If not every region can be had, the pool grows by
+ * what was got; -ENOMEM is returned only if that is nothing at all.
+ */
+int fio_chunk_init(unsigned int chunk_size_mb)
+{
+    struct kfio_chunk_region *regions, *old;
+    int i, n, old_n, old_size;
+
+    if (chunk_size_mb == 0)
+    {
+        return 0;
+    }
+
+    sx_xlock(&chunk_grow_lock);
+
+    // Only init and deinit change the table size, and they hold chunk_grow_lock.
+    old_n = chunk_nregions;
+    n = howmany((uint64_t)chunk_size_mb * 1024 * 1024, KFIO_CHUNK_REGION_SIZE);
+    regions = kfio_malloc((old_n + n) * sizeof(*regions));
+    if (NULL == regions)
+    {
+        sx_xunlock(&chunk_grow_lock);
+        return -ENOMEM;
+    }
+    kfio_memset(regions, 0, (old_n + n) * sizeof(*regions));
+
+    for (i = 0; i < n; i++)
+    {
+        regions[old_n + i].vaddr = (char *)kmem_alloc_contig(KFIO_CHUNK_REGION_SIZE, M_NOWAIT,
+            0, ~(vm_paddr_t)0, KFIO_CHUNK_REGION_SIZE, 0, VM_MEMATTR_DEFAULT);
+        if (NULL == regions[old_n + i].vaddr)
+        {
+            break;
+        }
+        regions[old_n + i].nfree = KFIO_CHUNK_REGION_PAGES;
+    }
+
+    if (i == 0)
+    {
+        kfio_free(regions, (old_n + n) * sizeof(*regions));
+        sx_xunlock(&chunk_grow_lock);
+        errprint("Could not reserve any of %u MB for the chunk page allocator\n", chunk_size_mb);
+        return -ENOMEM;
+    }
+    if (i < n)
+    {
+        infprint("Chunk page allocator reserved %d of %u MB\n",
+                 i * (KFIO_CHUNK_REGION_SIZE / (1024 * 1024)), chunk_size_mb);
+    }
+
+    mtx_lock(&chunk_lock);
+    old      = chunk_regions;
+    old_size = chunk_regions_size;
+    if (old_n > 0)
+    {
+        kfio_memcpy(regions, old, old_n * sizeof(*regions));
+    }
+    qsort(regions, old_n + i, sizeof(*regions), kfio_chunk_region_cmp);
+
+    chunk_regions      = regions;
+    chunk_nregions     = old_n + i;
+    chunk_regions_size = old_n + n;
+    chunk_hint         = 0;
+    chunk_pages_total += i * KFIO_CHUNK_REGION_PAGES;
+    chunk_pages_free  += i * KFIO_CHUNK_REGION_PAGES;
+    mtx_unlock(&chunk_lock);
+
+    if (old != NULL)
+    {
+        kfio_free(old, old_size * sizeof(*old));
+    }
+    sx_xunlock(&chunk_grow_lock);
+
+    dbgprint(DBGS_GENERAL, "Chunk page allocator: %d regions, %d pages\n",
+             old_n + i, chunk_pages_total);
+    return 0;
+}
+
+/**
+ * @brief bytes currently reserved by the chunk page allocator.
+ */
+fio_size_t fio_chunk_reserved_bytes(void)
+{
+    return (fio_size_t)chunk_pages_total * PAGE_SIZE;
+}
+
+/**
+ * @brief releases the regions. If pages are still handed out the regions
+ * are leaked rather than pulled from under their users.
+ */
+void fio_chunk_deinit(void)
+{
+    struct kfio_chunk_region *regions;
+    int i, n, size;
+
+    sx_xlock(&chunk_grow_lock);
+    mtx_lock(&chunk_lock);
+    regions = chunk_regions;
+    n = chunk_nregions;
+    size = chunk_regions_size;
+    if (chunk_pages_free != chunk_pages_total)
+    {
+        errprint("Chunk page allocator torn down with %d pages in use\n",
+                 chunk_pages_total - chunk_pages_free);
+        regions = NULL;
+    }
+    chunk_regions      = NULL;
+    chunk_nregions     = 0;
+    chunk_regions_size = 0;
+    chunk_pages_total  = 0;
+    chunk_pages_free   = 0;
+    mtx_unlock(&chunk_lock);
+    sx_xunlock(&chunk_grow_lock);
+
+    if (NULL == regions)
+    {
+        return;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+#if __FreeBSD_version >= 1400000
+        kmem_free(regions[i].vaddr, KFIO_CHUNK_REGION_SIZE);
+#else
+        kmem_free((vm_offset_t)regions[i].vaddr, KFIO_CHUNK_REGION_SIZE);
+#endif
+    }
+    kfio_free(regions, size * sizeof(*regions));
+}
+
+/**
+ * @brief returns a page from the reserved regions, or NULL if there is
+ * none. The page is not zeroed.
+ */
+void *fio_chunk_alloc_page(void)
+{
+    struct kfio_chunk_region *r = NULL;
+    void *pg;
+    int i, idx;
+
+    mtx_lock(&chunk_lock);
+    if (chunk_pages_free == 0)
+    {
+        if (chunk_regions != NULL)
+        {
+            chunk_page_misses++;
+        }
+        mtx_unlock(&chunk_lock);
+        return NULL;
+    }
+
+    // Keep filling the region used last so the rest stay untouched.
+    for (i = 0; i < chunk_nregions; i++)
+    {
+        r = &chunk_regions[(chunk_hint + i) % chunk_nregions];
+        if (r->nfree > 0)
+        {
+            break;
+        }
+    }
+    chunk_hint = (chunk_hint + i) % chunk_nregions;
+
+    bit_ffc(r->used, KFIO_CHUNK_REGION_PAGES, &idx);
+    KASSERT(idx >= 0, ("chunk region with %d free has no clear bit", r->nfree));
+    bit_set(r->used, idx);
+    r->nfree--;
+    chunk_pages_free--;
+    pg = r->vaddr + (size_t)idx * PAGE_SIZE;
+    mtx_unlock(&chunk_lock);
+
+    return pg;
+}
+
+/**
+ * @brief returns a page to its region.
+ *
+ * @return 0 if the page came from fio_chunk_alloc_page(), -EINVAL if it did
+ * not and belongs to someone else.
+ */
+int fio_chunk_free_page(void *pg)
+{
+    struct kfio_chunk_region *r;
+    int lo, hi, mid, idx;
+
+    mtx_lock(&chunk_lock);
+    lo = 0;
+    hi = chunk_nregions - 1;
+    while (lo <= hi)
+    {
+        mid = (lo + hi) / 2;
+        r = &chunk_regions[mid];
+
+        if ((char *)pg < r->vaddr)
+        {
+            hi = mid - 1;
+        }
+        else if ((char *)pg >= r->vaddr + KFIO_CHUNK_REGION_SIZE)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            idx = ((char *)pg - r->vaddr) / PAGE_SIZE;
+            KASSERT(bit_test(r->used, idx), ("chunk page %p freed twice", pg));
+            bit_clear(r->used, idx);
+            r->nfree++;
+            chunk_pages_free++;
+            mtx_unlock(&chunk_lock);
+            return 0;
+        }
+    }
+    mtx_unlock(&chunk_lock);
+
+    return -EINVAL;
+}
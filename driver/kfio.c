@@ -31,6 +31,7 @@
 
 #include "port-internal.h"
 
+#include <sys/cpuset.h>
 #include <sys/kdb.h>
 #include <sys/kthread.h>
 #include <sys/poll.h>
@@ -253,6 +254,36 @@ const char *kfio_pci_name(kfio_pci_dev_t *pdev)
     return pd->pci_name;
 }
 
+/**
+ * @brief returns the memory domain the card's slot is attached to.
+ */
+kfio_numa_node_t kfio_pci_get_node(kfio_pci_dev_t *pdev)
+{
+    struct kfio_freebsd_pci_dev *pd = device_get_softc(pdev);
+
+    return pd->numa_node >= 0 ? pd->numa_node : 0;
+}
+
+/**
+ * @brief restricts the calling kernel thread to the CPUs of a domain.
+ */
+void kfio_bind_kthread_to_node(kfio_numa_node_t node)
+{
+    cpuset_t mask;
+    int domain = kfio_numa_domain(node);
+
+    if (domain < 0)
+    {
+        return;
+    }
+
+    CPU_COPY(&cpuset_domain[domain], &mask);
+    if (cpuset_setthread(curthread->td_tid, &mask) != 0)
+    {
+        dbgprint(DBGS_GENERAL, "%s: cannot bind thread to domain %d\n", __func__, domain);
+    }
+}
+
 uint16_t kfio_pci_get_vendor(kfio_pci_dev_t *pdev)
 {
     return pci_get_vendor(pdev);
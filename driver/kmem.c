@@ -34,23 +34,252 @@
 #include "pci_dev.h"
 
 #include <sys/malloc.h>
+#include <sys/bitstring.h>
 #include <sys/bus.h>
+#include <sys/counter.h>
+#include <sys/domainset.h>
+#include <sys/eventhandler.h>
+#include <sys/queue.h>
+#include <sys/smp.h>
+#include <sys/sx.h>
+#include <sys/sysctl.h>
+#include <sys/taskqueue.h>
+#include <sys/vmem.h>
 #include <machine/bus.h>
 #include <machine/resource.h>
 #include <machine/bus_dma.h>
 #include <machine/param.h>
+#include <machine/vmparam.h>
 #include <vm/vm.h>
 #include <vm/vm_extern.h>
+#include <vm/vm_kern.h>
 #include <vm/pmap.h>
+#include <vm/vm_map.h>
+#include <vm/vm_page.h>
+#include <vm/vm_phys.h>
 
 
 static MALLOC_DEFINE(M_FUSION_IO, FIO_DRIVER_NAME, "Fusion-io driver buffers");
 
+/*
+ * Allocation classes accounted under hw.fio.mem; caches are accounted per
+ * cache under hw.fio.cache.
+ */
+enum
+{
+    KFIO_MEM_MALLOC,
+    KFIO_MEM_VMALLOC,
+    KFIO_MEM_DMA_COHERENT,
+    KFIO_MEM_PAGES,
+    KFIO_MEM_CLASSES
+};
+
+static const char *mem_acct_names[KFIO_MEM_CLASSES] = { "malloc", "vmalloc", "dma_coherent", "pages" };
+static struct kfio_mem_acct mem_acct[KFIO_MEM_CLASSES];
+static struct sysctl_ctx_list mem_acct_ctx;
+
+#define KFIO_MEM_ACCT_BATCH_BYTES (256 * 1024)
+#define KFIO_MEM_ACCT_BATCH_OBJS  64
+
+SYSCTL_DECL(_hw_fio);
+static SYSCTL_NODE(_hw_fio, OID_AUTO, mem, CTLFLAG_RD, 0, "fio memory usage");
+
+void kfio_mem_acct_init(struct kfio_mem_acct *acct)
+{
+    kfio_memset(acct, 0, sizeof(*acct));
+    acct->cpu = malloc((mp_maxid + 1) * sizeof(*acct->cpu), M_FUSION_IO, M_WAITOK | M_ZERO);
+}
+
+void kfio_mem_acct_fini(struct kfio_mem_acct *acct)
+{
+    free(acct->cpu, M_FUSION_IO);
+    acct->cpu = NULL;
+}
+
+static inline void kfio_mem_acct_raise(long *hwm, long v)
+{
+    long cur;
+
+    while ((cur = *(volatile long *)hwm) < v && !atomic_cmpset_long((u_long *)hwm, cur, v))
+        ;
+}
+
+void kfio_mem_acct_add(struct kfio_mem_acct *acct, long bytes, long objs)
+{
+    struct kfio_mem_acct_cpu *c;
+    int flush = 0;
+
+    if (NULL == acct->cpu)
+    {
+        return;
+    }
+
+    critical_enter();
+    c = &acct->cpu[curcpu];
+    c->bytes += bytes;
+    c->objs  += objs;
+    if (c->bytes >= KFIO_MEM_ACCT_BATCH_BYTES || c->bytes <= -KFIO_MEM_ACCT_BATCH_BYTES ||
+        c->objs >= KFIO_MEM_ACCT_BATCH_OBJS || c->objs <= -KFIO_MEM_ACCT_BATCH_OBJS)
+    {
+        bytes = c->bytes;
+        objs  = c->objs;
+        c->bytes = 0;
+        c->objs  = 0;
+        flush = 1;
+    }
+    critical_exit();
+
+    if (flush)
+    {
+        kfio_mem_acct_raise(&acct->bytes_hwm,
+                            (long)atomic_fetchadd_long((u_long *)&acct->bytes, bytes) + bytes);
+        kfio_mem_acct_raise(&acct->objs_hwm,
+                            (long)atomic_fetchadd_long((u_long *)&acct->objs, objs) + objs);
+    }
+}
+
+/*
+ * arg2 selects bytes (0), objects (1), or their high-water marks (2, 3).
+ * Current values include the deltas not yet folded in.
+ */
+static int kfio_mem_acct_handler(SYSCTL_HANDLER_ARGS)
+{
+    struct kfio_mem_acct *acct = arg1;
+    long bytes = acct->bytes, objs = acct->objs, val;
+    u_int cpu;
+
+    if (acct->cpu != NULL)
+    {
+        CPU_FOREACH(cpu)
+        {
+            bytes += acct->cpu[cpu].bytes;
+            objs  += acct->cpu[cpu].objs;
+        }
+    }
+
+    switch (arg2)
+    {
+    case 0:  val = bytes; break;
+    case 1:  val = objs; break;
+    case 2:  val = MAX(acct->bytes_hwm, bytes); break;
+    default: val = MAX(acct->objs_hwm, objs); break;
+    }
+    return sysctl_handle_long(oidp, &val, 0, req);
+}
+
+void kfio_mem_acct_sysctl(struct kfio_mem_acct *acct, struct sysctl_ctx_list *ctx,
+                          struct sysctl_oid *oid)
+{
+    SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(oid), OID_AUTO, "bytes",
+                    CTLTYPE_LONG | CTLFLAG_RD | CTLFLAG_MPSAFE, acct, 0,
+                    kfio_mem_acct_handler, "L", "Bytes allocated");
+    SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(oid), OID_AUTO, "objects",
+                    CTLTYPE_LONG | CTLFLAG_RD | CTLFLAG_MPSAFE, acct, 1,
+                    kfio_mem_acct_handler, "L", "Objects allocated");
+    SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(oid), OID_AUTO, "bytes_hwm",
+                    CTLTYPE_LONG | CTLFLAG_RD | CTLFLAG_MPSAFE, acct, 2,
+                    kfio_mem_acct_handler, "L", "Most bytes allocated at once");
+    SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(oid), OID_AUTO, "objects_hwm",
+                    CTLTYPE_LONG | CTLFLAG_RD | CTLFLAG_MPSAFE, acct, 3,
+                    kfio_mem_acct_handler, "L", "Most objects allocated at once");
+}
+
+static void
+kfio_mem_acct_sysinit(void *arg __unused)
+{
+    struct sysctl_oid *oid;
+    int cls;
+
+    sysctl_ctx_init(&mem_acct_ctx);
+    for (cls = 0; cls < KFIO_MEM_CLASSES; cls++)
+    {
+        kfio_mem_acct_init(&mem_acct[cls]);
+        oid = SYSCTL_ADD_NODE(&mem_acct_ctx, SYSCTL_STATIC_CHILDREN(_hw_fio_mem), OID_AUTO,
+                              mem_acct_names[cls], CTLFLAG_RD, 0, "allocation class");
+        if (oid != NULL)
+        {
+            kfio_mem_acct_sysctl(&mem_acct[cls], &mem_acct_ctx, oid);
+        }
+    }
+}
+SYSINIT(fio_mem_acct, SI_SUB_DRIVERS, SI_ORDER_FIRST, kfio_mem_acct_sysinit, NULL);
+
+static void
+kfio_mem_acct_sysuninit(void *arg __unused)
+{
+    int cls;
+
+    sysctl_ctx_free(&mem_acct_ctx);
+    for (cls = 0; cls < KFIO_MEM_CLASSES; cls++)
+    {
+        kfio_mem_acct_fini(&mem_acct[cls]);
+    }
+}
+SYSUNINIT(fio_mem_acct, SI_SUB_DRIVERS, SI_ORDER_FIRST, kfio_mem_acct_sysuninit, NULL);
+
+struct kfio_dma_chunk;
+
 struct _fusion_freebsd_dma {
     bus_dma_tag_t  tag;
     bus_dmamap_t   map;
+    struct kfio_dma_chunk *chunk;   /* NULL if tag and map belong to this buffer alone */
+    bus_size_t     offset;          /* of the buffer within the chunk */
 } __attribute((aligned(8)));
 
+CTASSERT(sizeof(struct _fusion_freebsd_dma) <= sizeof(((struct fusion_dma_t *)0)->_private));
+
+/*
+ * Small coherent buffers (descriptors, status words) are carved out of
+ * KFIO_DMA_CHUNK_SIZE chunks, each with a single tag and map, instead of
+ * paying for a tag, an allocation and a map load apiece. Each chunk serves
+ * one power-of-two size class from KFIO_DMA_SLAB_MIN up, so every buffer
+ * is naturally aligned and, the chunk being aligned to its size, can never
+ * straddle the parent tag's boundary.
+ */
+#define KFIO_DMA_CHUNK_SIZE (16 * PAGE_SIZE)
+#define KFIO_DMA_SLAB_MIN   64
+#define KFIO_DMA_SLAB_MAX   (KFIO_DMA_SLAB_MIN << (KFIO_DMA_SLAB_CLASSES - 1))
+
+struct kfio_dma_chunk
+{
+    LIST_ENTRY(kfio_dma_chunk) link;
+    bus_dma_tag_t  tag;
+    bus_dmamap_t   map;
+    char          *vaddr;
+    bus_addr_t     busaddr;
+    int            cls;
+    int            nobjs;
+    int            nfree;
+    bitstr_t       bit_decl(used, KFIO_DMA_CHUNK_SIZE / KFIO_DMA_SLAB_MIN);
+};
+
+static int dma_slab_max = KFIO_DMA_SLAB_MAX;
+TUNABLE_INT("hw.fio.dma_slab_max", &dma_slab_max);
+SYSCTL_INT(_hw_fio, OID_AUTO, dma_slab_max, CTLFLAG_RW, &dma_slab_max, KFIO_DMA_SLAB_MAX, "Largest coherent DMA allocation carved from a shared chunk (0=disable).");
+
+static int dma_slab_chunks;
+SYSCTL_INT(_hw_fio, OID_AUTO, dma_slab_chunks, CTLFLAG_RD, &dma_slab_chunks, 0, "Coherent DMA chunks allocated for small buffers");
+static counter_u64_t dma_slab_alloc_count;
+static counter_u64_t dma_coherent_alloc_count;
+SYSCTL_COUNTER_U64(_hw_fio, OID_AUTO, dma_slab_alloc_count, CTLFLAG_RD, &dma_slab_alloc_count, "Coherent DMA allocations carved from a shared chunk");
+SYSCTL_COUNTER_U64(_hw_fio, OID_AUTO, dma_coherent_alloc_count, CTLFLAG_RD, &dma_coherent_alloc_count, "Coherent DMA allocations given their own tag and map");
+
+static void
+kfio_dma_counters_init(void *arg __unused)
+{
+    dma_slab_alloc_count     = counter_u64_alloc(M_WAITOK);
+    dma_coherent_alloc_count = counter_u64_alloc(M_WAITOK);
+}
+SYSINIT(fio_dma_counters, SI_SUB_DRIVERS, SI_ORDER_FIRST, kfio_dma_counters_init, NULL);
+
+static void
+kfio_dma_counters_fini(void *arg __unused)
+{
+    counter_u64_free(dma_slab_alloc_count);
+    counter_u64_free(dma_coherent_alloc_count);
+}
+SYSUNINIT(fio_dma_counters, SI_SUB_DRIVERS, SI_ORDER_FIRST, kfio_dma_counters_fini, NULL);
+
 /**
  * Called from bus_dmamap_load(..)
  */
@@ -66,6 +295,223 @@ static void kfio_map_dma_callback(void *arg, bus_dma_segment_t *segs,
     dma_handle->phys_addr = segs->ds_addr;
 }
 
+static void kfio_dma_chunk_callback(void *arg, bus_dma_segment_t *segs,
+                                    int nseg, int error)
+{
+    struct kfio_dma_chunk *chunk = arg;
+
+    if (error)
+       return;
+
+    KASSERT(nseg == 1, ("Expected single segment, got %d", nseg));
+    chunk->busaddr = segs->ds_addr;
+}
+
+static void kfio_dma_chunk_free(struct kfio_dma_chunk *chunk)
+{
+    bus_dmamap_unload(chunk->tag, chunk->map);
+    bus_dmamem_free(chunk->tag, chunk->vaddr, chunk->map);
+    bus_dma_tag_destroy(chunk->tag);
+    kfio_free(chunk, sizeof(*chunk));
+    atomic_subtract_int(&dma_slab_chunks, 1);
+}
+
+static struct kfio_dma_chunk *kfio_dma_chunk_alloc(struct kfio_freebsd_pci_dev *pd, int cls)
+{
+    struct kfio_dma_chunk *chunk;
+    void *vaddr;
+    int rc;
+
+    chunk = kfio_malloc(sizeof(*chunk));
+    if (NULL == chunk)
+    {
+        return NULL;
+    }
+    kfio_memset(chunk, 0, sizeof(*chunk));
+
+    rc = bus_dma_tag_create(pd->parent_dma_tag, KFIO_DMA_CHUNK_SIZE, 0, BUS_SPACE_MAXADDR,
+        BUS_SPACE_MAXADDR, NULL, NULL, KFIO_DMA_CHUNK_SIZE, 1, KFIO_DMA_CHUNK_SIZE, 0,
+        NULL, NULL, &chunk->tag);
+    if (rc)
+    {
+        goto free_chunk;
+    }
+
+    rc = bus_dmamem_alloc(chunk->tag, &vaddr, BUS_DMA_WAITOK | BUS_DMA_COHERENT, &chunk->map);
+    if (rc)
+    {
+        goto free_tag;
+    }
+
+    rc = bus_dmamap_load(chunk->tag, chunk->map, vaddr, KFIO_DMA_CHUNK_SIZE,
+            kfio_dma_chunk_callback, chunk, BUS_DMA_NOCACHE | BUS_DMA_NOWAIT);
+    if (rc)
+    {
+        kfio_print("%s:%i Error %d in loading DMA chunk map\n", __FUNCTION__, __LINE__, rc);
+        goto free_mem;
+    }
+
+    chunk->vaddr = vaddr;
+    chunk->cls   = cls;
+    chunk->nobjs = KFIO_DMA_CHUNK_SIZE / (KFIO_DMA_SLAB_MIN << cls);
+    chunk->nfree = chunk->nobjs;
+    atomic_add_int(&dma_slab_chunks, 1);
+    return chunk;
+
+free_mem:
+    bus_dmamem_free(chunk->tag, vaddr, chunk->map);
+free_tag:
+    bus_dma_tag_destroy(chunk->tag);
+free_chunk:
+    kfio_free(chunk, sizeof(*chunk));
+    return NULL;
+}
+
+void kfio_dma_slab_init(struct kfio_freebsd_pci_dev *pd)
+{
+    int cls;
+
+    mtx_init(&pd->dma_slab_lock, "fio dma slab", NULL, MTX_DEF);
+    for (cls = 0; cls < KFIO_DMA_SLAB_CLASSES; cls++)
+    {
+        LIST_INIT(&pd->dma_slab[cls]);
+    }
+}
+
+/*
+ * Releases every chunk. The core frees its coherent memory before detach;
+ * anything still carved out at this point is leaked by the caller.
+ */
+void kfio_dma_slab_destroy(struct kfio_freebsd_pci_dev *pd)
+{
+    struct kfio_dma_chunk *chunk;
+    int cls;
+
+    if (!mtx_initialized(&pd->dma_slab_lock))
+    {
+        return;
+    }
+
+    for (cls = 0; cls < KFIO_DMA_SLAB_CLASSES; cls++)
+    {
+        while ((chunk = LIST_FIRST(&pd->dma_slab[cls])) != NULL)
+        {
+            LIST_REMOVE(chunk, link);
+            if (chunk->nfree != chunk->nobjs)
+            {
+                device_printf(pd->dev, "%d coherent DMA buffers of %d bytes not freed\n",
+                              chunk->nobjs - chunk->nfree, KFIO_DMA_SLAB_MIN << cls);
+            }
+            kfio_dma_chunk_free(chunk);
+        }
+    }
+    mtx_destroy(&pd->dma_slab_lock);
+}
+
+/*
+ * Carves size bytes out of a chunk of the matching class, allocating a new
+ * chunk if all are full. Returns NULL if size is not slab sized or no chunk
+ * could be had, in which case the caller falls back to a private tag.
+ */
+static void *kfio_dma_slab_alloc(struct kfio_freebsd_pci_dev *pd, unsigned int size,
+                                 struct fusion_dma_t *dma_handle)
+{
+    struct _fusion_freebsd_dma *pfd = (struct _fusion_freebsd_dma *)&dma_handle->_private;
+    struct kfio_dma_chunk *chunk, *fresh = NULL;
+    int cls, idx;
+
+    if (size > (unsigned int)MIN(dma_slab_max, KFIO_DMA_SLAB_MAX) ||
+        !mtx_initialized(&pd->dma_slab_lock))
+    {
+        return NULL;
+    }
+    for (cls = 0; (KFIO_DMA_SLAB_MIN << cls) < size; cls++)
+        ;
+
+    mtx_lock(&pd->dma_slab_lock);
+    for (;;)
+    {
+        LIST_FOREACH(chunk, &pd->dma_slab[cls], link)
+        {
+            if (chunk->nfree > 0)
+            {
+                break;
+            }
+        }
+        if (chunk != NULL || fresh != NULL)
+        {
+            break;
+        }
+
+        // Chunk allocation sleeps; drop the lock and look again afterwards.
+        mtx_unlock(&pd->dma_slab_lock);
+        fresh = kfio_dma_chunk_alloc(pd, cls);
+        if (NULL == fresh)
+        {
+            return NULL;
+        }
+        mtx_lock(&pd->dma_slab_lock);
+    }
+
+    if (NULL == chunk)
+    {
+        chunk = fresh;
+        fresh = NULL;
+        LIST_INSERT_HEAD(&pd->dma_slab[cls], chunk, link);
+    }
+
+    bit_ffc(chunk->used, chunk->nobjs, &idx);
+    KASSERT(idx >= 0, ("DMA chunk with %d free has no clear bit", chunk->nfree));
+    bit_set(chunk->used, idx);
+    chunk->nfree--;
+    mtx_unlock(&pd->dma_slab_lock);
+
+    // Another thread found room while this one slept; drop the new chunk.
+    if (fresh != NULL)
+    {
+        kfio_dma_chunk_free(fresh);
+    }
+
+    pfd->tag    = chunk->tag;
+    pfd->map    = chunk->map;
+    pfd->chunk  = chunk;
+    pfd->offset = (bus_size_t)idx * (KFIO_DMA_SLAB_MIN << cls);
+    dma_handle->phys_addr = chunk->busaddr + pfd->offset;
+
+    counter_u64_add(dma_slab_alloc_count, 1);
+    return chunk->vaddr + pfd->offset;
+}
+
+/*
+ * Returns a buffer to its chunk. A chunk that empties is released unless
+ * it is the last one of its class.
+ */
+static void kfio_dma_slab_free(struct kfio_freebsd_pci_dev *pd, struct _fusion_freebsd_dma *pfd)
+{
+    struct kfio_dma_chunk *chunk = pfd->chunk;
+    int idx = pfd->offset / (KFIO_DMA_SLAB_MIN << chunk->cls);
+
+    mtx_lock(&pd->dma_slab_lock);
+    KASSERT(bit_test(chunk->used, idx), ("DMA chunk buffer %d freed twice", idx));
+    bit_clear(chunk->used, idx);
+    chunk->nfree++;
+    if (chunk->nfree == chunk->nobjs &&
+        (LIST_FIRST(&pd->dma_slab[chunk->cls]) != chunk || LIST_NEXT(chunk, link) != NULL))
+    {
+        LIST_REMOVE(chunk, link);
+    }
+    else
+    {
+        chunk = NULL;
+    }
+    mtx_unlock(&pd->dma_slab_lock);
+
+    if (chunk != NULL)
+    {
+        kfio_dma_chunk_free(chunk);
+    }
+}
+
 /**
  *  @brief allocates locked down memory suitable for DMA transfers.
  *  @param pdev - pointer to device handle
@@ -88,6 +534,15 @@ void noinline *kfio_dma_alloc_coherent(kfio_pci_dev_t *pdev, unsigned int size,
 
     FUSION_ALLOCATION_TRIPWIRE_TEST();
 
+    vaddr = kfio_dma_slab_alloc(pd, size, dma_handle);
+    if (vaddr != NULL)
+    {
+        kfio_mem_acct_add(&mem_acct[KFIO_MEM_DMA_COHERENT], size, 1);
+        return vaddr;
+    }
+    pfd->chunk  = NULL;
+    pfd->offset = 0;
+
     rc = bus_dma_tag_create(pd->parent_dma_tag, 8, 0, BUS_SPACE_MAXADDR,
         BUS_SPACE_MAXADDR, NULL, NULL, size, 1, size, 0, NULL, NULL, &pfd->tag);
 
@@ -138,6 +593,8 @@ void noinline *kfio_dma_alloc_coherent(kfio_pci_dev_t *pdev, unsigned int size,
         goto free_mem;
     }
 
+    counter_u64_add(dma_coherent_alloc_count, 1);
+    kfio_mem_acct_add(&mem_acct[KFIO_MEM_DMA_COHERENT], size, 1);
     return vaddr;
 free_mem:
     bus_dmamem_free(pfd->tag, vaddr, pfd->map);
@@ -157,6 +614,18 @@ void noinline kfio_dma_free_coherent(kfio_pci_dev_t *pdev, unsigned int size,
     struct _fusion_freebsd_dma *pfd =
             (struct _fusion_freebsd_dma *) &dma_handle->_private;
 
+    kfio_mem_acct_add(&mem_acct[KFIO_MEM_DMA_COHERENT], -(long)size, -1);
+
+    if (pfd->chunk != NULL)
+    {
+        kfio_dma_slab_free(device_get_softc(pdev), pfd);
+        pfd->tag   = NULL;
+        pfd->map   = NULL;
+        pfd->chunk = NULL;
+        dma_handle->phys_addr = 0;
+        return;
+    }
+
     bus_dmamap_unload(pfd->tag, pfd->map);
     bus_dmamem_free(pfd->tag, vaddr, pfd->map);
     bus_dma_tag_destroy(pfd->tag);
@@ -166,6 +635,28 @@ void noinline kfio_dma_free_coherent(kfio_pci_dev_t *pdev, unsigned int size,
     dma_handle->phys_addr = 0;
 }
 
+/*
+ * Off by default: the shipped libkfio is built without PCI NUMA info and
+ * passes node 0 for every node-aware allocation, which would pin all of it
+ * to domain 0.  Only enable this with a core rebuilt against this port.
+ */
+static int numa_alloc = 0;
+TUNABLE_INT("hw.fio.numa_alloc", &numa_alloc);
+SYSCTL_INT(_hw_fio, OID_AUTO, numa_alloc, CTLFLAG_RW, &numa_alloc, 0, "Prefer the memory domain the core asks for in node-aware allocations (1=enable, 0=disable).");
+
+/**
+ * @brief maps a core NUMA node to a memory domain, or -1 to let the
+ * default policy choose.
+ */
+int kfio_numa_domain(kfio_numa_node_t node)
+{
+    if (!numa_alloc || node < 0 || node >= vm_ndomains)
+    {
+        return -1;
+    }
+    return node;
+}
+
 static void *__kfio_malloc(fio_size_t size)
 {
     /* align to cache line (64 bytes on x64)
@@ -174,6 +665,22 @@ static void *__kfio_malloc(fio_size_t size)
     return malloc(MAX(64, size), M_FUSION_IO, M_WAITOK);
 }
 
+/*
+ * The domain is a preference: malloc_domainset() falls back to the other
+ * domains rather than fail when the preferred one is short of memory.
+ */
+static void *__kfio_malloc_node(fio_size_t size, kfio_numa_node_t node, int flags)
+{
+    int domain = kfio_numa_domain(node);
+
+    FUSION_ALLOCATION_TRIPWIRE_TEST();
+    if (domain < 0)
+    {
+        return malloc(MAX(64, size), M_FUSION_IO, flags);
+    }
+    return malloc_domainset(MAX(64, size), M_FUSION_IO, DOMAINSET_PREF(domain), flags);
+}
+
 /**
  * @brief allocates kernel wired memory, hopefully aligned on cache line
  *        boundary. Unfortunately, FreeBSD kernel does not expose underlying
@@ -184,38 +691,181 @@ static void *__kfio_malloc(fio_size_t size)
  */
 void *noinline kfio_malloc(fio_size_t size)
 {
+    kfio_mem_acct_add(&mem_acct[KFIO_MEM_MALLOC], size, 1);
     return __kfio_malloc(size);
 }
 
 void *noinline kfio_malloc_node(fio_size_t size, kfio_numa_node_t node)
 {
-    return __kfio_malloc(size);
+    kfio_mem_acct_add(&mem_acct[KFIO_MEM_MALLOC], size, 1);
+    return __kfio_malloc_node(size, node, M_WAITOK);
+}
+
+/*
+ * Emergency reserve for atomic allocations. kfio_malloc_atomic() never
+ * sleeps: it tries M_NOWAIT first and, when the VM cannot satisfy that,
+ * takes a buffer from a per-size-class reserve of malloc(9) buffers. The
+ * reserve is topped back up from a taskqueue, where sleeping is fine.
+ * Reserve buffers are ordinary M_FUSION_IO allocations, so kfio_free()
+ * releases them like any other. Requests above a page are not covered.
+ */
+#define KFIO_ATOMIC_RESERVE_MIN_SHIFT 6
+#define KFIO_ATOMIC_RESERVE_CLASSES   (PAGE_SHIFT - KFIO_ATOMIC_RESERVE_MIN_SHIFT + 1)
+
+struct kfio_atomic_reserve
+{
+    void *head;      // buffers linked through their first word
+    int   depth;
+};
+
+static struct kfio_atomic_reserve atomic_reserve[KFIO_ATOMIC_RESERVE_CLASSES];
+static struct mtx atomic_reserve_lock;
+MTX_SYSINIT(fio_atomic_reserve, &atomic_reserve_lock, "fio_arsv", MTX_DEF);
+static struct task atomic_reserve_task;
+static int atomic_reserve_avail;
+
+static int atomic_reserve_depth = 16;
+TUNABLE_INT("hw.fio.atomic_reserve", &atomic_reserve_depth);
+SYSCTL_INT(_hw_fio, OID_AUTO, atomic_reserve, CTLFLAG_RW, &atomic_reserve_depth, 16, "Buffers kept per size class for atomic allocations the VM cannot satisfy.");
+SYSCTL_INT(_hw_fio, OID_AUTO, atomic_reserve_avail, CTLFLAG_RD, &atomic_reserve_avail, 0, "Buffers currently in the atomic allocation reserve");
+static u_long atomic_reserve_used;
+SYSCTL_ULONG(_hw_fio, OID_AUTO, atomic_reserve_used, CTLFLAG_RD, &atomic_reserve_used, 0, "Atomic allocations served from the reserve");
+static u_long atomic_reserve_refills;
+SYSCTL_ULONG(_hw_fio, OID_AUTO, atomic_reserve_refills, CTLFLAG_RD, &atomic_reserve_refills, 0, "Reserve refill passes");
+static u_long atomic_alloc_failures;
+SYSCTL_ULONG(_hw_fio, OID_AUTO, atomic_alloc_failures, CTLFLAG_RD, &atomic_alloc_failures, 0, "Atomic allocations that failed");
+
+static void
+kfio_atomic_reserve_refill(void *arg __unused, int pending __unused)
+{
+    void *buf;
+    int cls;
+
+    for (cls = 0; cls < KFIO_ATOMIC_RESERVE_CLASSES; cls++)
+    {
+        while (atomic_reserve[cls].depth < atomic_reserve_depth)
+        {
+            buf = malloc(1 << (cls + KFIO_ATOMIC_RESERVE_MIN_SHIFT), M_FUSION_IO, M_WAITOK);
+
+            mtx_lock(&atomic_reserve_lock);
+            *(void **)buf = atomic_reserve[cls].head;
+            atomic_reserve[cls].head = buf;
+            atomic_reserve[cls].depth++;
+            atomic_reserve_avail++;
+            mtx_unlock(&atomic_reserve_lock);
+        }
+    }
+
+    mtx_lock(&atomic_reserve_lock);
+    atomic_reserve_refills++;
+    mtx_unlock(&atomic_reserve_lock);
+}
+
+static void
+kfio_atomic_reserve_init(void *arg __unused)
+{
+    TASK_INIT(&atomic_reserve_task, 0, kfio_atomic_reserve_refill, NULL);
+    kfio_atomic_reserve_refill(NULL, 0);
+}
+SYSINIT(fio_atomic_reserve, SI_SUB_DRIVERS, SI_ORDER_FIRST, kfio_atomic_reserve_init, NULL);
+
+static void
+kfio_atomic_reserve_fini(void *arg __unused)
+{
+    void *buf;
+    int cls;
+
+    taskqueue_drain(taskqueue_thread, &atomic_reserve_task);
+
+    for (cls = 0; cls < KFIO_ATOMIC_RESERVE_CLASSES; cls++)
+    {
+        while ((buf = atomic_reserve[cls].head) != NULL)
+        {
+            atomic_reserve[cls].head = *(void **)buf;
+            free(buf, M_FUSION_IO);
+        }
+        atomic_reserve[cls].depth = 0;
+    }
+    atomic_reserve_avail = 0;
+}
+SYSUNINIT(fio_atomic_reserve, SI_SUB_DRIVERS, SI_ORDER_FIRST, kfio_atomic_reserve_fini, NULL);
+
+static void *
+kfio_atomic_reserve_take(fio_size_t size)
+{
+    void *buf = NULL;
+    int cls;
+
+    size = MAX(64, size);
+    if (size <= PAGE_SIZE)
+    {
+        cls = fls(size - 1) - KFIO_ATOMIC_RESERVE_MIN_SHIFT;
+
+        mtx_lock(&atomic_reserve_lock);
+        buf = atomic_reserve[cls].head;
+        if (buf != NULL)
+        {
+            atomic_reserve[cls].head = *(void **)buf;
+            atomic_reserve[cls].depth--;
+            atomic_reserve_avail--;
+            atomic_reserve_used++;
+        }
+        else
+        {
+            atomic_alloc_failures++;
+        }
+        mtx_unlock(&atomic_reserve_lock);
+
+        taskqueue_enqueue(taskqueue_thread, &atomic_reserve_task);
+    }
+    else
+    {
+        mtx_lock(&atomic_reserve_lock);
+        atomic_alloc_failures++;
+        mtx_unlock(&atomic_reserve_lock);
+    }
+    return buf;
 }
 
 /**
+ * @brief allocates wired memory without sleeping; may return NULL.
  */
-static void *__kfio_malloc_atomic(fio_size_t size)
+static void *__kfio_malloc_atomic(fio_size_t size, kfio_numa_node_t node)
 {
+    void *buf;
+
     /* Align to cache line (64 bytes on x64).
      * N.B. the returned memory is wired */
-    FUSION_ALLOCATION_TRIPWIRE_TEST();
-    return malloc(MAX(64, size), M_FUSION_IO, M_WAITOK);
+    buf = __kfio_malloc_node(size, node, M_NOWAIT);
+    if (buf == NULL)
+    {
+        buf = kfio_atomic_reserve_take(size);
+    }
+    if (buf != NULL)
+    {
+        kfio_mem_acct_add(&mem_acct[KFIO_MEM_MALLOC], size, 1);
+    }
+    return buf;
 }
 
 void* noinline kfio_malloc_atomic(fio_size_t size)
 {
-    return __kfio_malloc_atomic(size);
+    return __kfio_malloc_atomic(size, -1);
 }
 
 void* noinline kfio_malloc_atomic_node(fio_size_t size, kfio_numa_node_t node)
 {
-    return __kfio_malloc_atomic(size);
+    return __kfio_malloc_atomic(size, node);
 }
 
 /**
  */
 void noinline kfio_free(void *ptr, fio_size_t size)
 {
+    if (ptr != NULL)
+    {
+        kfio_mem_acct_add(&mem_acct[KFIO_MEM_MALLOC], -(long)size, -1);
+    }
     free(ptr, M_FUSION_IO);
 }
 
@@ -223,16 +873,264 @@ void noinline kfio_free(void *ptr, fio_size_t size)
  * @brief allocates virtual memory mapped into kernel space that is
  * not assumed to be contiguous.  Linux does assume the memory is wired.
  */
-void *noinline kfio_vmalloc(fio_size_t size)
-{
-    FUSION_ALLOCATION_TRIPWIRE_TEST();
-    return malloc(size, M_FUSION_IO, M_WAITOK);
-}
-
-/**
+/*
+ * Superpage backing for large kfio_vmalloc() requests, such as the core's
+ * forward and reverse maps. Memory comes in 2MB physically contiguous,
+ * 2MB aligned runs; a request that fits in one contiguous span is used
+ * through the direct map, which amd64 maps with superpages, so random
+ * lookups in a multi-GB map do not miss the TLB on every 4K page. Requests
+ * of at least hw.fio.vmalloc_superpage_min bytes (never less than one
+ * superpage) are served this way; 0 disables it. A request that cannot be
+ * backed falls back to malloc(9).
+ */
+#define KFIO_SUPERPAGE_SIZE (2 * 1024 * 1024)
+
+static int vmalloc_superpage_min = 0;
+TUNABLE_INT("hw.fio.vmalloc_superpage_min", &vmalloc_superpage_min);
+SYSCTL_INT(_hw_fio, OID_AUTO, vmalloc_superpage_min, CTLFLAG_RW, &vmalloc_superpage_min, 0, "Smallest kfio_vmalloc() request served from superpage backed memory, in bytes (0=disable).");
+static u_long vmalloc_superpage_count;
+SYSCTL_ULONG(_hw_fio, OID_AUTO, vmalloc_superpage_count, CTLFLAG_RD, &vmalloc_superpage_count, 0, "kfio_vmalloc() requests served from superpage backed memory");
+static u_long vmalloc_superpage_fallbacks;
+SYSCTL_ULONG(_hw_fio, OID_AUTO, vmalloc_superpage_fallbacks, CTLFLAG_RD, &vmalloc_superpage_fallbacks, 0, "Large kfio_vmalloc() requests that fell back to malloc");
+static u_long vmalloc_superpage_spans;
+SYSCTL_ULONG(_hw_fio, OID_AUTO, vmalloc_superpage_spans, CTLFLAG_RD, &vmalloc_superpage_spans, 0, "Bytes of kfio_vmalloc() memory currently backed by 2MB runs");
+
+#if defined(__amd64__)
+/*
+ * One record per superpage backed allocation, so kfio_vfree() can tell it
+ * from malloc(9) memory by address alone and release the size actually
+ * allocated, whatever size the caller passes back. Records are hashed on
+ * the 2MB aligned address; frees of anything else, or while no records
+ * exist, never take the lock.
+ */
+struct kfio_superpage_span
+{
+    LIST_ENTRY(kfio_superpage_span) link;
+    vm_offset_t                     va;
+    vm_size_t                       len;
+    int                             dmap;
+};
+
+#define KFIO_SUPERPAGE_HASH 64
+#define KFIO_SUPERPAGE_BUCKET(va) \
+    (&superpage_hash[((va) / KFIO_SUPERPAGE_SIZE) & (KFIO_SUPERPAGE_HASH - 1)])
+
+static LIST_HEAD(kfio_superpage_list, kfio_superpage_span) superpage_hash[KFIO_SUPERPAGE_HASH];
+static volatile u_int superpage_span_count;
+static struct mtx superpage_lock;
+MTX_SYSINIT(fio_superpage, &superpage_lock, "fio_spage", MTX_DEF);
+
+static vm_page_t kfio_superpage_contig(u_long npages)
+{
+#if __FreeBSD_version >= 1400000
+    return vm_page_alloc_noobj_contig(VM_ALLOC_WIRED | VM_ALLOC_NORMAL,
+        npages, 0, ~(vm_paddr_t)0, KFIO_SUPERPAGE_SIZE, 0, VM_MEMATTR_DEFAULT);
+#else
+    return vm_page_alloc_contig(NULL, 0, VM_ALLOC_NOOBJ | VM_ALLOC_WIRED | VM_ALLOC_NORMAL,
+        npages, 0, ~(vm_paddr_t)0, KFIO_SUPERPAGE_SIZE, 0, VM_MEMATTR_DEFAULT);
+#endif
+}
+
+static void kfio_superpage_free_pages(vm_paddr_t pa, vm_size_t len)
+{
+    vm_page_t m;
+    vm_size_t off;
+
+    for (off = 0; off < len; off += PAGE_SIZE)
+    {
+        m = PHYS_TO_VM_PAGE(pa + off);
+        vm_page_unwire_noq(m);
+        vm_page_free(m);
+    }
+}
+
+/*
+ * Backs [va, va + len) with 2MB physically contiguous, 2MB aligned runs,
+ * entered with 4K mappings. Returns the number of bytes backed.
+ */
+static vm_size_t kfio_superpage_back(vm_offset_t va, vm_size_t len)
+{
+    vm_page_t m;
+    vm_size_t off, pg;
+
+    for (off = 0; off < len; off += KFIO_SUPERPAGE_SIZE)
+    {
+        m = kfio_superpage_contig(atop(KFIO_SUPERPAGE_SIZE));
+        if (NULL == m)
+        {
+            break;
+        }
+        for (pg = 0; pg < KFIO_SUPERPAGE_SIZE; pg += PAGE_SIZE)
+        {
+            pmap_kenter(va + off + pg, VM_PAGE_TO_PHYS(m) + pg);
+        }
+    }
+    return off;
+}
+
+/*
+ * Unmaps and frees the first len bytes backed by kfio_superpage_back().
+ */
+static void kfio_superpage_unback(vm_offset_t va, vm_size_t len)
+{
+    vm_paddr_t pa;
+    vm_size_t off;
+
+    for (off = 0; off < len; off += KFIO_SUPERPAGE_SIZE)
+    {
+        pa = pmap_kextract(va + off);
+        pmap_qremove(va + off, atop(KFIO_SUPERPAGE_SIZE));
+        kfio_superpage_free_pages(pa, KFIO_SUPERPAGE_SIZE);
+    }
+}
+
+/*
+ * A request that fits in one physically contiguous span is handed out
+ * through the direct map, which amd64 maps with superpages. Otherwise it
+ * gets its own 2MB aligned kernel VA range backed run by run, so a
+ * multi-GB map never needs one huge contiguous span.
+ */
+static void *kfio_superpage_alloc(fio_size_t size)
+{
+    struct kfio_superpage_span *span;
+    vmem_addr_t va;
+    vm_size_t len, backed;
+    vm_page_t m;
+
+    if (vmalloc_superpage_min <= 0 || size < MAX(vmalloc_superpage_min, KFIO_SUPERPAGE_SIZE))
+    {
+        return NULL;
+    }
+
+    len = roundup2(size, KFIO_SUPERPAGE_SIZE);
+    span = malloc(sizeof(*span), M_FUSION_IO, M_NOWAIT);
+    if (NULL == span)
+    {
+        goto fallback;
+    }
+
+    m = kfio_superpage_contig(atop(len));
+    if (m != NULL)
+    {
+        va = PHYS_TO_DMAP(VM_PAGE_TO_PHYS(m));
+        span->dmap = 1;
+    }
+    else
+    {
+        if (vmem_xalloc(kernel_arena, len, KFIO_SUPERPAGE_SIZE, 0, 0, VMEM_ADDR_MIN,
+                        VMEM_ADDR_MAX, M_BESTFIT | M_NOWAIT, &va) != 0)
+        {
+            free(span, M_FUSION_IO);
+            goto fallback;
+        }
+
+        backed = kfio_superpage_back(va, len);
+        if (backed < len)
+        {
+            kfio_superpage_unback(va, backed);
+            vmem_xfree(kernel_arena, va, len);
+            free(span, M_FUSION_IO);
+            goto fallback;
+        }
+        span->dmap = 0;
+    }
+
+    span->va  = va;
+    span->len = len;
+    mtx_lock(&superpage_lock);
+    LIST_INSERT_HEAD(KFIO_SUPERPAGE_BUCKET(va), span, link);
+    atomic_add_int(&superpage_span_count, 1);
+    mtx_unlock(&superpage_lock);
+
+    atomic_add_long(&vmalloc_superpage_spans, len);
+    atomic_add_long(&vmalloc_superpage_count, 1);
+    return (void *)va;
+
+fallback:
+    atomic_add_long(&vmalloc_superpage_fallbacks, 1);
+    return NULL;
+}
+
+static int kfio_superpage_free(void *ptr)
+{
+    struct kfio_superpage_span *span;
+    vm_offset_t va = (vm_offset_t)ptr;
+
+    if (ptr == NULL || (va & (KFIO_SUPERPAGE_SIZE - 1)) != 0 ||
+        atomic_load_int(&superpage_span_count) == 0)
+    {
+        return 0;
+    }
+
+    mtx_lock(&superpage_lock);
+    LIST_FOREACH(span, KFIO_SUPERPAGE_BUCKET(va), link)
+    {
+        if (span->va == va)
+        {
+            LIST_REMOVE(span, link);
+            atomic_subtract_int(&superpage_span_count, 1);
+            break;
+        }
+    }
+    mtx_unlock(&superpage_lock);
+
+    if (NULL == span)
+    {
+        return 0;
+    }
+
+    if (span->dmap)
+    {
+        kfio_superpage_free_pages(DMAP_TO_PHYS(span->va), span->len);
+    }
+    else
+    {
+        kfio_superpage_unback(span->va, span->len);
+        vmem_xfree(kernel_arena, span->va, span->len);
+    }
+    atomic_subtract_long(&vmalloc_superpage_spans, span->len);
+    free(span, M_FUSION_IO);
+    return 1;
+}
+#else
+static void *kfio_superpage_alloc(fio_size_t size)
+{
+    return NULL;
+}
+
+static int kfio_superpage_free(void *ptr)
+{
+    return 0;
+}
+#endif
+
+void *noinline kfio_vmalloc(fio_size_t size)
+{
+    void *ptr;
+
+    FUSION_ALLOCATION_TRIPWIRE_TEST();
+    kfio_mem_acct_add(&mem_acct[KFIO_MEM_VMALLOC], size, 1);
+
+    ptr = kfio_superpage_alloc(size);
+    if (ptr != NULL)
+    {
+        return ptr;
+    }
+    return malloc(size, M_FUSION_IO, M_WAITOK);
+}
+
+/**
  */
 void noinline kfio_vfree(void *ptr, fio_size_t sz)
 {
+    if (ptr != NULL)
+    {
+        kfio_mem_acct_add(&mem_acct[KFIO_MEM_VMALLOC], -(long)sz, -1);
+    }
+    if (kfio_superpage_free(ptr))
+    {
+        return;
+    }
     free(ptr, M_FUSION_IO);
 }
 
@@ -243,7 +1141,11 @@ void noinline kfio_vfree(void *ptr, fio_size_t sz)
  */
 void noinline kfio_free_page(fusion_page_t pg)
 {
-    free(pg, M_FUSION_IO);
+    kfio_mem_acct_add(&mem_acct[KFIO_MEM_PAGES], -PAGE_SIZE, -1);
+    if (fio_chunk_free_page(pg) != 0)
+    {
+        free(pg, M_FUSION_IO);
+    }
 }
 
 /** @brief returns fusion_page_t for a virtual address
@@ -266,31 +1168,460 @@ void * noinline kfio_page_address(fusion_page_t pg)
  */
 fusion_page_t noinline kfio_alloc_0_page(kfio_maa_t flags)
 {
+    void *pg;
     int kmflag = 0;
 
-    if (!(flags & (KFIO_MAA_NOIO | KFIO_MAA_NOWAIT)) )
-        kmflag = M_WAITOK;
-    if (flags & KFIO_MAA_NOIO)
-        kmflag = M_NOWAIT;
-    if (flags & KFIO_MAA_NOWAIT)
-        kmflag = M_NOWAIT;
+    pg = fio_chunk_alloc_page();
+    if (pg != NULL)
+    {
+        kfio_memset(pg, 0, PAGE_SIZE);
+    }
+    else
+    {
+        if (!(flags & (KFIO_MAA_NOIO | KFIO_MAA_NOWAIT)) )
+            kmflag = M_WAITOK;
+        if (flags & KFIO_MAA_NOIO)
+            kmflag = M_NOWAIT;
+        if (flags & KFIO_MAA_NOWAIT)
+            kmflag = M_NOWAIT;
+
+        pg = malloc(PAGE_SIZE, M_FUSION_IO, kmflag | M_ZERO);
+    }
 
-    return malloc(PAGE_SIZE, M_FUSION_IO, kmflag | M_ZERO);
+    if (pg != NULL)
+    {
+        kfio_mem_acct_add(&mem_acct[KFIO_MEM_PAGES], PAGE_SIZE, 1);
+    }
+    return pg;
+}
+
+/*
+ * Preallocation. The core reads preallocate_memory itself; its entries are
+ * adapter serial numbers. The port gives each listed device one share of
+ * preallocate_mb, once the core has brought the device up far enough to
+ * create its block device. The core does not export the serial number, so
+ * the port reads it from the SN keyword of the card's PCI VPD; since not
+ * every card has one, an entry may also name the device by PCI location
+ * (<domain>:<bus>:<slot>.<func>, as in include_devices) or by unit name.
+ * Devices that match no entry are logged. A share first warms the zones
+ * behind the request caches named in hw.fio.preallocate_caches and the SGL
+ * pools, and the rest is added to the chunk page allocator that backs the
+ * core's metadata pages.
+ */
+static struct sx prealloc_lock;
+SX_SYSINIT(fio_prealloc, &prealloc_lock, "fio_prealloc");
+static int prealloc_devices;
+static u_long prealloc_cache_bytes;
+static u_long prealloc_sgl_bytes;
+static u_long prealloc_page_bytes;
+SYSCTL_INT(_hw_fio, OID_AUTO, prealloc_devices, CTLFLAG_RD, &prealloc_devices, 0, "Listed devices given a share of preallocate_mb");
+SYSCTL_ULONG(_hw_fio, OID_AUTO, prealloc_cache_bytes, CTLFLAG_RD, &prealloc_cache_bytes, 0, "Bytes preallocated in request caches");
+SYSCTL_ULONG(_hw_fio, OID_AUTO, prealloc_sgl_bytes, CTLFLAG_RD, &prealloc_sgl_bytes, 0, "Bytes preallocated in SGL pools");
+SYSCTL_ULONG(_hw_fio, OID_AUTO, prealloc_page_bytes, CTLFLAG_RD, &prealloc_page_bytes, 0, "Bytes preallocated for metadata pages");
+
+static int kfio_prealloc_count_entries(const char *list)
+{
+    int n = 0;
+
+    while (*list != '\0')
+    {
+        if (*list != ',' && (list[1] == ',' || list[1] == '\0'))
+        {
+            n++;
+        }
+        list++;
+    }
+    return n;
+}
+
+/*
+ * Most objects of size bytes that preallocation may put in one zone when
+ * count of them are wanted per listed device. Zones that take part set
+ * this as their UMA reserve when they are created.
+ */
+int kfio_prealloc_reserve(int count, fio_size_t size)
+{
+    fio_size_t n;
+
+    if (preallocate_memory[0] == '\0' || preallocate_mb <= 0 || count <= 0)
+    {
+        return 0;
+    }
+
+    n = (fio_size_t)kfio_prealloc_count_entries(preallocate_memory) * count;
+    n = MIN(n, ((fio_size_t)preallocate_mb << 20) / size);
+    return (int)MIN(n, INT_MAX);
+}
+
+/**
+ * called from kfio_block_create_device()
+ */
+void kfio_prealloc_device(struct kfio_freebsd_pci_dev *pd)
+{
+    fio_size_t limit, used, share, cache_bytes, sgl_bytes, page_bytes;
+    const char *serial;
+    int entries;
+
+    if (preallocate_memory[0] == '\0' || preallocate_mb <= 0 || pd->prealloc_done)
+    {
+        return;
+    }
+
+    if (pci_get_vpd_readonly(pd->dev, "SN", &serial) != 0)
+    {
+        serial = NULL;
+    }
+    if (!(serial != NULL && kfio_name_listed(preallocate_memory, serial)) &&
+        !kfio_name_listed(preallocate_memory, pd->pci_name) &&
+        !kfio_name_listed(preallocate_memory, device_get_nameunit(pd->dev)))
+    {
+        device_printf(pd->dev, "serial %s, location %s not listed in preallocate_memory, nothing preallocated\n",
+                      serial != NULL ? serial : "unknown", pd->pci_name);
+        return;
+    }
+
+    entries = kfio_prealloc_count_entries(preallocate_memory);
+
+    sx_xlock(&prealloc_lock);
+    pd->prealloc_done = 1;
+
+    limit = (fio_size_t)preallocate_mb << 20;
+    used  = prealloc_cache_bytes + prealloc_sgl_bytes + prealloc_page_bytes;
+    share = MIN(limit / entries, limit > used ? limit - used : 0);
+
+    cache_bytes = kfio_cache_warm(max_requests, share);
+    sgl_bytes   = kfio_sgl_pools_warm(max_requests, share - cache_bytes);
+
+    page_bytes = fio_chunk_reserved_bytes();
+    if (share - cache_bytes - sgl_bytes >= (1 << 20))
+    {
+        (void)fio_chunk_init((share - cache_bytes - sgl_bytes) >> 20);
+    }
+    page_bytes = fio_chunk_reserved_bytes() - page_bytes;
+
+    prealloc_cache_bytes += cache_bytes;
+    prealloc_sgl_bytes   += sgl_bytes;
+    prealloc_page_bytes  += page_bytes;
+    prealloc_devices++;
+    sx_xunlock(&prealloc_lock);
+
+    device_printf(pd->dev, "preallocated %ju KB requests, %ju KB SGLs, %ju KB metadata pages\n",
+                  (uintmax_t)cache_bytes >> 10, (uintmax_t)sgl_bytes >> 10,
+                  (uintmax_t)page_bytes >> 10);
 }
 
 /*---------------------------------------------------------------------------*/
 
+/*
+ * busdma has no ranged sync, so offset and length are unused and every
+ * sync covers the whole map. Buffers carved from a DMA slab chunk share
+ * one map with the rest of the chunk; on amd64 that memory satisfies the
+ * slab tag and is never bounced, so for those a fence that orders CPU
+ * accesses against the device's is all a sync has to do, and syncing one
+ * buffer does not sync the whole chunk. Buffers with their own map, and
+ * every buffer with hw.fio.dma_sync_busdma set, still go through
+ * bus_dmamap_sync().
+ */
+static int dma_sync_busdma = 0;
+TUNABLE_INT("hw.fio.dma_sync_busdma", &dma_sync_busdma);
+SYSCTL_INT(_hw_fio, OID_AUTO, dma_sync_busdma, CTLFLAG_RW, &dma_sync_busdma, 0, "Sync DMA slab buffers through bus_dmamap_sync() rather than with a memory fence (1=enable, 0=disable).");
+
 int kfio_dma_sync(struct fusion_dma_t *dma_hdl, uint64_t offset, size_t length, unsigned type)
 {
     struct _fusion_freebsd_dma *pfd =
                       (struct _fusion_freebsd_dma *) &dma_hdl->_private;
+    bus_dmasync_op_t op;
 
-    bus_dmamap_sync(pfd->tag, pfd->map,
-        type == KFIO_DMA_SYNC_FOR_DRIVER ? BUS_DMASYNC_POSTREAD : BUS_DMASYNC_PREWRITE);
+    switch (type)
+    {
+    case KFIO_DMA_SYNC_FOR_DRIVER:
+        op = BUS_DMASYNC_POSTREAD | BUS_DMASYNC_POSTWRITE;
+        break;
+    case KFIO_DMA_SYNC_FOR_DEVICE:
+        op = BUS_DMASYNC_PREREAD | BUS_DMASYNC_PREWRITE;
+        break;
+    default:
+        /* Unknown types keep the PREWRITE sync the port always did. */
+        op = BUS_DMASYNC_PREWRITE;
+        break;
+    }
+
+#if defined(__amd64__)
+    if (pfd->chunk != NULL && !dma_sync_busdma)
+    {
+        if (type == KFIO_DMA_SYNC_FOR_DRIVER)
+        {
+            atomic_thread_fence_acq();
+        }
+        else
+        {
+            atomic_thread_fence_rel();
+        }
+        return 0;
+    }
+#endif
+
+    bus_dmamap_sync(pfd->tag, pfd->map, op);
 
     return 0;
 }
 
+/*
+ * User page holds. The core gets the user virtual address of each page,
+ * which is what kfio_sgl_map_user_pages() maps, while the vm_page_t array
+ * from vm_fault_quick_hold_pages() is kept here until kfio_put_user_pages().
+ *
+ * Released ranges may be parked, still held, in a small per-process cache
+ * so that a buffer an application passes on every ioctl is not faulted in
+ * and held again each time. A cached range is only reused if every page is
+ * still mapped at the same physical address, and a process's entries are
+ * dropped when it forks (copy-on-write would make them unsafe for writes),
+ * execs or exits.
+ */
+struct kfio_user_hold
+{
+    TAILQ_ENTRY(kfio_user_hold) link;
+    struct proc  *proc;
+    vm_offset_t   start;
+    int           npages;
+    vm_prot_t     prot;
+    vm_page_t     ma[1];
+};
+
+TAILQ_HEAD(kfio_user_hold_list, kfio_user_hold);
+
+#define KFIO_USER_HOLD_SIZE(npages) \
+    (sizeof(struct kfio_user_hold) + ((npages) - 1) * sizeof(vm_page_t))
+
+#define KFIO_USER_PIN_CACHE_MAX 256
+
+/*
+ * Holds in use are hashed on process and start address so that
+ * kfio_put_user_pages() finds its hold under a bucket lock, without a
+ * module-wide lock or list walk. Only the opt-in pin cache is global.
+ */
+#define KFIO_USER_HOLD_BUCKETS 64
+
+struct kfio_user_hold_bucket
+{
+    struct mtx                  lock;
+    struct kfio_user_hold_list  active;
+} __aligned(CACHE_LINE_SIZE);
+
+static struct kfio_user_hold_bucket user_hold_hash[KFIO_USER_HOLD_BUCKETS];
+
+static struct kfio_user_hold_list user_hold_cache  = TAILQ_HEAD_INITIALIZER(user_hold_cache);
+static int user_hold_cached;
+static struct mtx user_hold_lock;
+MTX_SYSINIT(fio_user_hold, &user_hold_lock, "fio_uhold", MTX_DEF);
+
+static int user_pin_cache = 0;
+TUNABLE_INT("hw.fio.user_pin_cache", &user_pin_cache);
+SYSCTL_INT(_hw_fio, OID_AUTO, user_pin_cache, CTLFLAG_RW, &user_pin_cache, 0, "Released user page ranges kept held per process for reuse (0=disable).");
+static counter_u64_t user_pin_hits;
+SYSCTL_COUNTER_U64(_hw_fio, OID_AUTO, user_pin_hits, CTLFLAG_RD, &user_pin_hits, "User page ranges found held in the pin cache");
+static counter_u64_t user_pin_misses;
+SYSCTL_COUNTER_U64(_hw_fio, OID_AUTO, user_pin_misses, CTLFLAG_RD, &user_pin_misses, "User page ranges faulted in and held");
+SYSCTL_INT(_hw_fio, OID_AUTO, user_pin_cached, CTLFLAG_RD, &user_hold_cached, 0, "User page ranges currently in the pin cache");
+
+static struct kfio_user_hold_bucket *
+kfio_user_hold_bucket(struct proc *p, vm_offset_t start)
+{
+    return &user_hold_hash[(atop(start) ^ ((uintptr_t)p >> 10)) % KFIO_USER_HOLD_BUCKETS];
+}
+
+static void
+kfio_user_hold_release(struct kfio_user_hold *uh)
+{
+    vm_page_unhold_pages(uh->ma, uh->npages);
+    kfio_free(uh, KFIO_USER_HOLD_SIZE(uh->npages));
+}
+
+static void
+kfio_user_hold_release_list(struct kfio_user_hold_list *list)
+{
+    struct kfio_user_hold *uh, *next;
+
+    TAILQ_FOREACH_SAFE(uh, list, link, next)
+    {
+        kfio_user_hold_release(uh);
+    }
+}
+
+/*
+ * Takes a matching range for process p out of the pin cache, or returns
+ * NULL. The caller owns the returned hold.
+ */
+static struct kfio_user_hold *
+kfio_user_hold_lookup(struct proc *p, vm_offset_t start, int npages, vm_prot_t prot)
+{
+    struct kfio_user_hold *uh;
+    pmap_t pmap;
+    int i;
+
+    if (user_hold_cached == 0)
+    {
+        return NULL;
+    }
+
+    mtx_lock(&user_hold_lock);
+    TAILQ_FOREACH(uh, &user_hold_cache, link)
+    {
+        if (uh->proc == p && uh->start == start && uh->npages == npages &&
+            (uh->prot & prot) == prot)
+        {
+            TAILQ_REMOVE(&user_hold_cache, uh, link);
+            user_hold_cached--;
+            break;
+        }
+    }
+    mtx_unlock(&user_hold_lock);
+
+    if (uh == NULL)
+    {
+        return NULL;
+    }
+
+    /*
+     * The range may have been made read-only since it was cached; a write
+     * hold must not outlive the write permission it was taken under.
+     */
+    if ((prot & VM_PROT_WRITE) != 0)
+    {
+        vm_map_t map = &p->p_vmspace->vm_map;
+        boolean_t writable;
+
+        vm_map_lock_read(map);
+        writable = vm_map_check_protection(map, start, start + ptoa(npages), VM_PROT_WRITE);
+        vm_map_unlock_read(map);
+
+        if (!writable)
+        {
+            kfio_user_hold_release(uh);
+            return NULL;
+        }
+    }
+
+    pmap = vmspace_pmap(p->p_vmspace);
+
+    for (i = 0; i < npages; i++)
+    {
+        if (pmap_extract(pmap, start + ptoa(i)) != VM_PAGE_TO_PHYS(uh->ma[i]))
+        {
+            kfio_user_hold_release(uh);
+            return NULL;
+        }
+    }
+
+    /*
+     * vm_fault_quick_hold_pages() dirtied the pages when they were first
+     * held for writing, but they may have been laundered since. The device
+     * writes them behind the pmap's back, so dirty them again here.
+     */
+    if ((prot & VM_PROT_WRITE) != 0)
+    {
+        for (i = 0; i < npages; i++)
+        {
+            vm_page_dirty(uh->ma[i]);
+        }
+    }
+    return uh;
+}
+
+/*
+ * Drops every cached range of process p. Used as the fork, exec and exit
+ * event handler and, with p == NULL, at module unload.
+ */
+static void
+kfio_user_hold_purge(struct proc *p)
+{
+    struct kfio_user_hold_list stale = TAILQ_HEAD_INITIALIZER(stale);
+    struct kfio_user_hold *uh, *next;
+
+    if (user_hold_cached == 0)
+    {
+        return;
+    }
+
+    mtx_lock(&user_hold_lock);
+    TAILQ_FOREACH_SAFE(uh, &user_hold_cache, link, next)
+    {
+        if (p == NULL || uh->proc == p)
+        {
+            TAILQ_REMOVE(&user_hold_cache, uh, link);
+            TAILQ_INSERT_TAIL(&stale, uh, link);
+            user_hold_cached--;
+        }
+    }
+    mtx_unlock(&user_hold_lock);
+
+    kfio_user_hold_release_list(&stale);
+}
+
+static void
+kfio_user_hold_exit(void *arg __unused, struct proc *p)
+{
+    kfio_user_hold_purge(p);
+}
+
+static void
+kfio_user_hold_fork(void *arg __unused, struct proc *p1, struct proc *p2 __unused, int flags __unused)
+{
+    kfio_user_hold_purge(p1);
+}
+
+static void
+kfio_user_hold_exec(void *arg __unused, struct proc *p, struct image_params *imgp __unused)
+{
+    kfio_user_hold_purge(p);
+}
+
+static eventhandler_tag user_hold_exit_tag;
+static eventhandler_tag user_hold_fork_tag;
+static eventhandler_tag user_hold_exec_tag;
+
+static void
+kfio_user_hold_init(void *arg __unused)
+{
+    int i;
+
+    for (i = 0; i < KFIO_USER_HOLD_BUCKETS; i++)
+    {
+        mtx_init(&user_hold_hash[i].lock, "fio_uhold_bucket", NULL, MTX_DEF);
+        TAILQ_INIT(&user_hold_hash[i].active);
+    }
+    user_pin_hits   = counter_u64_alloc(M_WAITOK);
+    user_pin_misses = counter_u64_alloc(M_WAITOK);
+
+    user_hold_exit_tag = EVENTHANDLER_REGISTER(process_exit, kfio_user_hold_exit,
+                                               NULL, EVENTHANDLER_PRI_ANY);
+    user_hold_fork_tag = EVENTHANDLER_REGISTER(process_fork, kfio_user_hold_fork,
+                                               NULL, EVENTHANDLER_PRI_ANY);
+    user_hold_exec_tag = EVENTHANDLER_REGISTER(process_exec, kfio_user_hold_exec,
+                                               NULL, EVENTHANDLER_PRI_ANY);
+}
+SYSINIT(fio_user_hold, SI_SUB_DRIVERS, SI_ORDER_FIRST, kfio_user_hold_init, NULL);
+
+static void
+kfio_user_hold_fini(void *arg __unused)
+{
+    int i;
+
+    EVENTHANDLER_DEREGISTER(process_exit, user_hold_exit_tag);
+    EVENTHANDLER_DEREGISTER(process_fork, user_hold_fork_tag);
+    EVENTHANDLER_DEREGISTER(process_exec, user_hold_exec_tag);
+
+    kfio_user_hold_purge(NULL);
+
+    for (i = 0; i < KFIO_USER_HOLD_BUCKETS; i++)
+    {
+        mtx_destroy(&user_hold_hash[i].lock);
+    }
+    counter_u64_free(user_pin_hits);
+    counter_u64_free(user_pin_misses);
+}
+SYSUNINIT(fio_user_hold, SI_SUB_DRIVERS, SI_ORDER_FIRST, kfio_user_hold_fini, NULL);
+
 /// @brief Pin the user pages in memory.
 /// Note:  This needs to be called from within a process
 ///        context (i.e. ioctl or other syscall) for the user address passed in
@@ -302,22 +1633,54 @@ int kfio_dma_sync(struct fusion_dma_t *dma_hdl, uint64_t offset, size_t length,
 /// @return          number of pages pinned
 int kfio_get_user_pages(fusion_user_page_t *pages, int nr_pages, fio_uintptr_t start, int write)
 {
-    int i, error;
+    struct proc *p = curproc;
+    struct kfio_user_hold_bucket *hb;
+    struct kfio_user_hold *uh;
+    vm_prot_t prot;
+    int i;
 
     start = trunc_page(start);
+    prot  = VM_PROT_READ | (write ? VM_PROT_WRITE : 0);
+
+    uh = kfio_user_hold_lookup(p, start, nr_pages, prot);
 
-    /* Lock whole  affected memory range  in single call. */
-    error = vslock((void *)start, nr_pages * FUSION_PAGE_SIZE);
-    if (error != 0)
+    if (uh != NULL)
     {
-        return -error;
+        counter_u64_add(user_pin_hits, 1);
     }
+    else
+    {
+        counter_u64_add(user_pin_misses, 1);
+
+        uh = kfio_malloc(KFIO_USER_HOLD_SIZE(nr_pages));
+        if (uh == NULL)
+        {
+            return -ENOMEM;
+        }
+
+        if (vm_fault_quick_hold_pages(&p->p_vmspace->vm_map, start,
+                                      ptoa(nr_pages), prot, uh->ma, nr_pages) < 0)
+        {
+            kfio_free(uh, KFIO_USER_HOLD_SIZE(nr_pages));
+            return -EFAULT;
+        }
+
+        uh->proc   = p;
+        uh->start  = start;
+        uh->npages = nr_pages;
+        uh->prot   = prot;
+    }
+
+    hb = kfio_user_hold_bucket(p, start);
+    mtx_lock(&hb->lock);
+    TAILQ_INSERT_HEAD(&hb->active, uh, link);
+    mtx_unlock(&hb->lock);
 
     /*
      * Split into individual page-sized chunks to conform
      * to the API idiosyncrasies.
      */
-    for (i = 0, error = 0; i < nr_pages; i++)
+    for (i = 0; i < nr_pages; i++)
     {
         pages[i] = (void *)start;
         start += FUSION_PAGE_SIZE;
@@ -336,26 +1699,65 @@ int kfio_get_user_pages(fusion_user_page_t *pages, int nr_pages, fio_uintptr_t s
 /// @return          none
 void kfio_put_user_pages(fusion_user_page_t *pages, int nr_pages)
 {
-    fio_uintptr_t start;
-    int i, j;
+    struct kfio_user_hold_list stale = TAILQ_HEAD_INITIALIZER(stale);
+    struct kfio_user_hold_bucket *hb;
+    struct kfio_user_hold *uh, *next;
+    struct proc *p = curproc;
+    int count;
 
-    /*
-     * Scan page list, coalescing contiguous regions.
-     * This undoes splitting done in kfio_get_user_pages.
-     */
-    for (i = 0; i < nr_pages; i = j)
+    if (nr_pages == 0)
     {
-        start = (fio_uintptr_t)pages[i];
+        return;
+    }
 
-        for (j = i + 1; j < nr_pages; j++)
+    hb = kfio_user_hold_bucket(p, (vm_offset_t)pages[0]);
+    mtx_lock(&hb->lock);
+    TAILQ_FOREACH(uh, &hb->active, link)
+    {
+        if (uh->proc == p && uh->start == (vm_offset_t)pages[0] && uh->npages == nr_pages)
         {
-            start += FUSION_PAGE_SIZE;
+            TAILQ_REMOVE(&hb->active, uh, link);
+            break;
+        }
+    }
+    mtx_unlock(&hb->lock);
 
-            if (start != (fio_uintptr_t)pages[j])
-            {
-                break;
-            }
+    if (uh == NULL)
+    {
+        errprint("%s: no hold for %d pages at %p\n", __func__, nr_pages, pages[0]);
+        return;
+    }
+
+    if (user_pin_cache <= 0)
+    {
+        kfio_user_hold_release(uh);
+        return;
+    }
+
+    mtx_lock(&user_hold_lock);
+    TAILQ_INSERT_HEAD(&user_hold_cache, uh, link);
+    user_hold_cached++;
+
+    // Trim this process back to its share, then the cache to its hard limit.
+    count = 0;
+    TAILQ_FOREACH_SAFE(uh, &user_hold_cache, link, next)
+    {
+        if (uh->proc == p && ++count > user_pin_cache)
+        {
+            TAILQ_REMOVE(&user_hold_cache, uh, link);
+            TAILQ_INSERT_TAIL(&stale, uh, link);
+            user_hold_cached--;
         }
-        vsunlock(pages[i], (j - i) * FUSION_PAGE_SIZE);
     }
+
+    while (user_hold_cached > KFIO_USER_PIN_CACHE_MAX)
+    {
+        uh = TAILQ_LAST(&user_hold_cache, kfio_user_hold_list);
+        TAILQ_REMOVE(&user_hold_cache, uh, link);
+        TAILQ_INSERT_TAIL(&stale, uh, link);
+        user_hold_cached--;
+    }
+    mtx_unlock(&user_hold_lock);
+
+    kfio_user_hold_release_list(&stale);
 }
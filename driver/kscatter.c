@@ -37,8 +37,31 @@
 #include <sys/bio.h>
 #include <sys/bus_dma.h>
 #include <sys/bus.h>
+#include <sys/counter.h>
+#include <sys/proc.h>
+#include <sys/queue.h>
+#include <sys/rmlock.h>
+#include <sys/sx.h>
+#include <sys/sysctl.h>
+#include <vm/vm.h>
+#include <vm/pmap.h>
+#include <vm/vm_map.h>
+#include <vm/uma.h>
+#include <machine/cpu.h>
 #include <fio/port/dbgset.h>
 
+/* Longest segment the SGL tags allow and that coalescing will build. */
+#define KFIO_SGL_MAX_SEG_LEN BUS_SPACE_MAXSIZE_32BIT
+
+/* Whether [addr, addr + len) stays within one KFIO_DMA_BOUNDARY window. */
+#define KFIO_SGL_SAME_WINDOW(addr, len) \
+    ((((addr) ^ ((addr) + (len) - 1)) & ~(KFIO_DMA_BOUNDARY - 1)) == 0)
+
+/*
+ * The DMA tag is shared by every SGL of the same size class on a device,
+ * so each SGL carries its own segment array: the tag's scratch segment
+ * array is not safe to use from concurrent loads.
+ */
 struct freebsd_sgl
 {
     uint32_t           uio_max;
@@ -46,12 +69,27 @@ struct freebsd_sgl
     uint32_t           uio_size;
     struct thread     *uio_td;
     enum uio_seg       uio_segflg;
+    uint32_t           uio_segs;   // DMA segments user pages will need
+    vm_paddr_t         uio_pa_seg; // physical start of the last segment
+    vm_paddr_t         uio_pa_end; // physical end of the last user page
     bus_dma_segment_t *seg_ptr;
     int                seg_num;
+    int                seg_max;
     kfio_pci_dev_t    *pci_dev;
     int                pci_dir;
     bus_dma_tag_t      dma_tag;
     bus_dmamap_t       dma_map;
+    int                dma_direct;
+    int                dma_loaded;
+    bus_dma_segment_t *seg_buf;
+    uint32_t          *seg_off;    // byte offset of each mapped segment
+    int                seg_hint;   // segment the last slice ended in
+    int                dma_translated;
+    int                dma_cached; // busdma load kept across an unmap
+    int                cache_segs;
+    int                phys_num;   // physical layout of the kept load
+    bus_dma_segment_t *phys_buf;
+    int                pool;       // size class, -1 if allocated individually
     struct iovec       uio_vec[1];
 };
 
@@ -67,25 +105,400 @@ struct kfio_dma_map
 };
 
 
+static struct sx sgl_dma_tag_lock;
+SX_SYSINIT(fio_sgl_dma_tag, &sgl_dma_tag_lock, "fio_sgl_tag");
+
+/*
+ * A long-lived kernel buffer mapped once at registration. SGLs built on
+ * top of it reuse the cached segments instead of loading a busdma map on
+ * every I/O, which matters when a DMAR unit makes each load expensive.
+ */
+struct kfio_dma_reg
+{
+    LIST_ENTRY(kfio_dma_reg) link;
+    kfio_pci_dev_t    *pci_dev;
+    vm_offset_t        va;
+    uint32_t           size;
+    bus_dma_tag_t      dma_tag;
+    bus_dmamap_t       dma_map;
+    int                seg_num;
+    int                seg_max;
+    bus_dma_segment_t  segs[1];
+};
+
+#define KFIO_DMA_REG_SIZE(nsegs) \
+    (sizeof(struct kfio_dma_reg) + ((nsegs) - 1) * sizeof(bus_dma_segment_t))
+
+static LIST_HEAD(, kfio_dma_reg) dma_reg_list = LIST_HEAD_INITIALIZER(dma_reg_list);
+static int dma_reg_count;
+static struct rmlock dma_reg_lock;
+RM_SYSINIT(fio_dma_reg, &dma_reg_lock, "fio_dma_reg");
+
+/*
+ * DMA mapping tunables and statistics. The cycle counters cover map plus
+ * unmap and are only updated with dma_map_stats set, so the two mapping
+ * paths can be compared on a live system by flipping dma_direct_map.
+ */
+SYSCTL_DECL(_hw_fio);
+
+static int dma_direct_map = 1;
+TUNABLE_INT("hw.fio.dma_direct_map", &dma_direct_map);
+SYSCTL_INT(_hw_fio, OID_AUTO, dma_direct_map, CTLFLAG_RW, &dma_direct_map, 1, "Map kernel buffers from the page tables when the device needs no address translation (1=enable, 0=disable).");
+static int dma_map_stats = 0;
+TUNABLE_INT("hw.fio.dma_map_stats", &dma_map_stats);
+SYSCTL_INT(_hw_fio, OID_AUTO, dma_map_stats, CTLFLAG_RW, &dma_map_stats, 0, "Account CPU cycles spent mapping, unmapping and copying scatter-gather lists.");
+static int dma_coalesce = 1;
+TUNABLE_INT("hw.fio.dma_coalesce", &dma_coalesce);
+SYSCTL_INT(_hw_fio, OID_AUTO, dma_coalesce, CTLFLAG_RW, &dma_coalesce, 1, "Merge physically adjacent segments returned by busdma (1=enable, 0=disable).");
+static int sgl_copy_nt_min = 256 * 1024;
+TUNABLE_INT("hw.fio.sgl_copy_nt_min", &sgl_copy_nt_min);
+SYSCTL_INT(_hw_fio, OID_AUTO, sgl_copy_nt_min, CTLFLAG_RW, &sgl_copy_nt_min, 256 * 1024, "Smallest kernel span copied with non-temporal stores between scatter-gather lists (0=never).");
+static int dmar_lazy_unmap = 0;
+TUNABLE_INT("hw.fio.dmar_lazy_unmap", &dmar_lazy_unmap);
+SYSCTL_INT(_hw_fio, OID_AUTO, dmar_lazy_unmap, CTLFLAG_RW, &dmar_lazy_unmap, 0, "Keep IOMMU mappings of kernel buffers loaded after I/O and reuse them when the same pages are mapped again (1=enable, 0=disable).");
+
+static counter_u64_t dma_map_direct_count;
+static counter_u64_t dma_map_direct_cycles;
+static counter_u64_t dma_map_busdma_count;
+static counter_u64_t dma_map_busdma_cycles;
+static counter_u64_t dma_map_segs_merged;
+static counter_u64_t dma_map_registered_count;
+static counter_u64_t dma_map_reused_count;
+static counter_u64_t dma_unmap_deferred_count;
+static counter_u64_t dma_unmap_stale_count;
+static counter_u64_t sgl_copy_bytes;
+static counter_u64_t sgl_copy_nt_bytes;
+static counter_u64_t sgl_copy_cycles;
+
+SYSCTL_COUNTER_U64(_hw_fio, OID_AUTO, dma_map_direct_count, CTLFLAG_RD, &dma_map_direct_count, "Scatter-gather lists mapped from the page tables");
+SYSCTL_COUNTER_U64(_hw_fio, OID_AUTO, dma_map_direct_cycles, CTLFLAG_RD, &dma_map_direct_cycles, "Cycles spent in page table mapping");
+SYSCTL_COUNTER_U64(_hw_fio, OID_AUTO, dma_map_busdma_count, CTLFLAG_RD, &dma_map_busdma_count, "Scatter-gather lists mapped through busdma");
+SYSCTL_COUNTER_U64(_hw_fio, OID_AUTO, dma_map_busdma_cycles, CTLFLAG_RD, &dma_map_busdma_cycles, "Cycles spent in busdma mapping and unmapping");
+SYSCTL_COUNTER_U64(_hw_fio, OID_AUTO, dma_map_segs_merged, CTLFLAG_RD, &dma_map_segs_merged, "Busdma segments folded into a physically adjacent neighbour");
+SYSCTL_COUNTER_U64(_hw_fio, OID_AUTO, dma_map_registered_count, CTLFLAG_RD, &dma_map_registered_count, "Scatter-gather lists mapped from registered buffers");
+SYSCTL_COUNTER_U64(_hw_fio, OID_AUTO, dma_map_reused_count, CTLFLAG_RD, &dma_map_reused_count, "Busdma loads reused because the same pages were mapped again");
+SYSCTL_COUNTER_U64(_hw_fio, OID_AUTO, dma_unmap_deferred_count, CTLFLAG_RD, &dma_unmap_deferred_count, "Busdma unloads deferred by dmar_lazy_unmap");
+SYSCTL_COUNTER_U64(_hw_fio, OID_AUTO, dma_unmap_stale_count, CTLFLAG_RD, &dma_unmap_stale_count, "Deferred busdma loads dropped because different pages were mapped");
+SYSCTL_INT(_hw_fio, OID_AUTO, dma_registered_buffers, CTLFLAG_RD, &dma_reg_count, 0, "Buffers with a persistent DMA mapping");
+SYSCTL_COUNTER_U64(_hw_fio, OID_AUTO, sgl_copy_bytes, CTLFLAG_RD, &sgl_copy_bytes, "Bytes copied between scatter-gather lists");
+SYSCTL_COUNTER_U64(_hw_fio, OID_AUTO, sgl_copy_nt_bytes, CTLFLAG_RD, &sgl_copy_nt_bytes, "Bytes copied between scatter-gather lists with non-temporal stores");
+SYSCTL_COUNTER_U64(_hw_fio, OID_AUTO, sgl_copy_cycles, CTLFLAG_RD, &sgl_copy_cycles, "Cycles spent copying between scatter-gather lists");
+
+static void
+kfio_sgl_counters_init(void *arg __unused)
+{
+    dma_map_direct_count  = counter_u64_alloc(M_WAITOK);
+    dma_map_direct_cycles = counter_u64_alloc(M_WAITOK);
+    dma_map_busdma_count  = counter_u64_alloc(M_WAITOK);
+    dma_map_busdma_cycles = counter_u64_alloc(M_WAITOK);
+    dma_map_segs_merged   = counter_u64_alloc(M_WAITOK);
+    dma_map_registered_count = counter_u64_alloc(M_WAITOK);
+    dma_map_reused_count     = counter_u64_alloc(M_WAITOK);
+    dma_unmap_deferred_count = counter_u64_alloc(M_WAITOK);
+    dma_unmap_stale_count    = counter_u64_alloc(M_WAITOK);
+    sgl_copy_bytes        = counter_u64_alloc(M_WAITOK);
+    sgl_copy_nt_bytes     = counter_u64_alloc(M_WAITOK);
+    sgl_copy_cycles       = counter_u64_alloc(M_WAITOK);
+}
+SYSINIT(fio_sgl_counters, SI_SUB_DRIVERS, SI_ORDER_FIRST, kfio_sgl_counters_init, NULL);
+
+static void
+kfio_sgl_counters_fini(void *arg __unused)
+{
+    counter_u64_free(dma_map_direct_count);
+    counter_u64_free(dma_map_direct_cycles);
+    counter_u64_free(dma_map_busdma_count);
+    counter_u64_free(dma_map_busdma_cycles);
+    counter_u64_free(dma_map_segs_merged);
+    counter_u64_free(dma_map_registered_count);
+    counter_u64_free(dma_map_reused_count);
+    counter_u64_free(dma_unmap_deferred_count);
+    counter_u64_free(dma_unmap_stale_count);
+    counter_u64_free(sgl_copy_bytes);
+    counter_u64_free(sgl_copy_nt_bytes);
+    counter_u64_free(sgl_copy_cycles);
+}
+SYSUNINIT(fio_sgl_counters, SI_SUB_DRIVERS, SI_ORDER_FIRST, kfio_sgl_counters_fini, NULL);
+
+static void
+kfio_sgl_probe_callback(void *arg, bus_dma_segment_t *segs, int nsegs, int error)
+{
+    bus_addr_t *addrp = arg;
+
+    if (error == 0 && nsegs == 1)
+        *addrp = segs[0].ds_addr;
+}
+
+/**
+ * @brief decides whether SGLs of this device may be mapped straight from
+ * the page tables. A page is loaded through the device's parent tag and
+ * the resulting bus address compared with its physical address: they
+ * differ when an IOMMU translates for the device or the tag bounces.
+ * called from iodrive_pci_probe()
+ */
+void
+kfio_sgl_dma_probe_direct(struct kfio_freebsd_pci_dev *pdev)
+{
+    bus_dmamap_t map;
+    bus_addr_t   addr;
+    void        *buf;
+
+    pdev->dma_direct = 0;
+    pdev->dma_translated = 0;
+
+    buf = kfio_malloc(PAGE_SIZE);
+    if (buf == NULL)
+    {
+        return;
+    }
+
+    if (bus_dmamap_create(pdev->parent_dma_tag, 0, &map) == 0)
+    {
+        addr = 0;
+
+        if (bus_dmamap_load(pdev->parent_dma_tag, map, buf, PAGE_SIZE,
+                            kfio_sgl_probe_callback, &addr, BUS_DMA_NOWAIT) == 0)
+        {
+            pdev->dma_direct = (addr == pmap_kextract((vm_offset_t)buf));
+            pdev->dma_translated = !pdev->dma_direct;
+            bus_dmamap_unload(pdev->parent_dma_tag, map);
+        }
+        bus_dmamap_destroy(pdev->parent_dma_tag, map);
+    }
+
+    kfio_free(buf, PAGE_SIZE);
+
+    dbgprint(DBGS_GENERAL, "%s: direct DMA mapping %s\n",
+             pdev->pci_name, pdev->dma_direct ? "enabled" : "disabled");
+
+    if (pdev->dma_translated)
+    {
+        device_printf(pdev->dev, "DMA is remapped by an IOMMU; busdma costs are "
+                      "reported under hw.fio.dma_map_*, see also hw.fio.dmar_lazy_unmap\n");
+    }
+
+    SYSCTL_ADD_INT(device_get_sysctl_ctx(pdev->dev),
+                   SYSCTL_CHILDREN(device_get_sysctl_tree(pdev->dev)), OID_AUTO,
+                   "dma_translated", CTLFLAG_RD, &pdev->dma_translated, 0,
+                   "DMA addresses are translated by an IOMMU");
+}
+
+static inline fio_size_t
+kfio_sgl_alloc_size(uint32_t nvecs, uint32_t nsegs)
+{
+    return sizeof(struct freebsd_sgl) + (nvecs - 1) * sizeof(struct iovec) +
+           nsegs * (2 * sizeof(bus_dma_segment_t) + sizeof(uint32_t));
+}
+
+/**
+ * @brief returns the device DMA tag shared by SGLs of up to *nsegsp segments,
+ * creating it the first time a list of that size class is allocated.
+ * On return *nsegsp holds the segment count of the class.
+ */
+static int
+kfio_sgl_get_dma_tag(struct kfio_freebsd_pci_dev *pdev, int *nsegsp, bus_dma_tag_t *tagp)
+{
+    int cls, rc;
+
+    cls = fls(*nsegsp - 1);
+    if (cls >= KFIO_SGL_DMA_TAG_CLASSES)
+    {
+        return EINVAL;
+    }
+
+    rc = 0;
+
+    sx_xlock(&sgl_dma_tag_lock);
+    if (pdev->sgl_dma_tag[cls] == NULL)
+    {
+        rc = bus_dma_tag_create(pdev->parent_dma_tag, 1, 0, BUS_SPACE_MAXADDR,
+                                BUS_SPACE_MAXADDR, NULL, NULL,
+                                BUS_SPACE_MAXSIZE_32BIT, 1 << cls,
+                                KFIO_SGL_MAX_SEG_LEN, BUS_DMA_ALLOCNOW,
+                                NULL, NULL, &pdev->sgl_dma_tag[cls]);
+    }
+    *tagp = pdev->sgl_dma_tag[cls];
+    sx_xunlock(&sgl_dma_tag_lock);
+
+    *nsegsp = 1 << cls;
+    return rc;
+}
+
+/*
+ * SGLs come from three size classes, each a UMA zone whose items hold the
+ * class's full iovec and segment arrays and are mapped through the shared
+ * tag for that segment count. Most I/O is a page or two, so the small class
+ * keeps those lists compact; larger requests than the large class are
+ * allocated individually.
+ */
+#define KFIO_SGL_POOLS 3
+
+static const int sgl_pool_nsegs[KFIO_SGL_POOLS] = { 4, 32, 256 };
+static const char *sgl_pool_name[KFIO_SGL_POOLS] = { "fio_sgl_small", "fio_sgl_medium", "fio_sgl_large" };
+static uma_zone_t sgl_pool_zone[KFIO_SGL_POOLS];
+static int sgl_pool_reserve[KFIO_SGL_POOLS];
+static int sgl_pool_warmed[KFIO_SGL_POOLS];
+
+static int sgl_pool_prealloc = 32;
+TUNABLE_INT("hw.fio.sgl_pool_prealloc", &sgl_pool_prealloc);
+SYSCTL_INT(_hw_fio, OID_AUTO, sgl_pool_prealloc, CTLFLAG_RD, &sgl_pool_prealloc, 32, "Scatter-gather lists preallocated in each size class at load.");
+
+static void
+kfio_sgl_pools_init(void *arg __unused)
+{
+    int pool, n;
+
+    for (pool = 0; pool < KFIO_SGL_POOLS; pool++)
+    {
+        n = sgl_pool_nsegs[pool];
+
+        sgl_pool_zone[pool] = uma_zcreate(sgl_pool_name[pool], kfio_sgl_alloc_size(n, n),
+                                          NULL, NULL, NULL, NULL, UMA_ALIGN_CACHE, 0);
+
+        // Room for what kfio_sgl_pools_warm() may add, set while the keg is empty.
+        sgl_pool_reserve[pool] = kfio_prealloc_reserve(max_requests >> (2 * pool),
+                                                       kfio_sgl_alloc_size(n, n));
+        if (sgl_pool_reserve[pool] > 0)
+        {
+            uma_zone_reserve(sgl_pool_zone[pool], sgl_pool_reserve[pool]);
+        }
+
+        if (sgl_pool_prealloc > 0)
+        {
+            uma_prealloc(sgl_pool_zone[pool], sgl_pool_prealloc);
+        }
+    }
+}
+SYSINIT(fio_sgl_pools, SI_SUB_DRIVERS, SI_ORDER_FIRST, kfio_sgl_pools_init, NULL);
+
+static void
+kfio_sgl_pools_fini(void *arg __unused)
+{
+    int pool;
+
+    for (pool = 0; pool < KFIO_SGL_POOLS; pool++)
+    {
+        uma_zdestroy(sgl_pool_zone[pool]);
+    }
+}
+SYSUNINIT(fio_sgl_pools, SI_SUB_DRIVERS, SI_ORDER_FIRST, kfio_sgl_pools_fini, NULL);
+
+/*
+ * Preallocates SGLs for a device being attached with preallocation: one
+ * small list per request and a quarter as many of each larger class, as
+ * far as budget bytes allow. The lists land in each zone's UMA reserve,
+ * which draining the zone leaves alone. Returns the bytes used.
+ */
+fio_size_t
+kfio_sgl_pools_warm(int nrequests, fio_size_t budget)
+{
+    fio_size_t used = 0, size;
+    int pool, n;
+
+    for (pool = 0; pool < KFIO_SGL_POOLS; pool++)
+    {
+        size = kfio_sgl_alloc_size(sgl_pool_nsegs[pool], sgl_pool_nsegs[pool]);
+        n = MIN(nrequests >> (2 * pool), (budget - used) / size);
+        n = MIN(n, sgl_pool_reserve[pool] - sgl_pool_warmed[pool]);
+        if (n > 0)
+        {
+            uma_prealloc(sgl_pool_zone[pool], n);
+            sgl_pool_warmed[pool] += n;
+            used += n * size;
+        }
+    }
+    return used;
+}
+
+/**
+ * called from iodrive_pci_remove() once the core has released all SGLs
+ */
+void
+kfio_sgl_dma_tags_destroy(struct kfio_freebsd_pci_dev *pdev)
+{
+    int cls;
+
+    for (cls = 0; cls < KFIO_SGL_DMA_TAG_CLASSES; cls++)
+    {
+        if (pdev->sgl_dma_tag[cls] != NULL)
+        {
+            bus_dma_tag_destroy(pdev->sgl_dma_tag[cls]);
+            pdev->sgl_dma_tag[cls] = NULL;
+        }
+    }
+}
+
 int
 kfio_sgl_alloc_nvec(kfio_pci_dev_t *pcidev, kfio_numa_node_t node, kfio_sg_list_t **sgl, int nvecs)
 {
     struct kfio_freebsd_pci_dev *pdev = device_get_softc(pcidev);
     struct freebsd_sgl *fsg;
+    bus_dma_tag_t tag;
+    int domain;
+    int pool;
+    int nsegs;
     int rc;
 
-    fsg = kfio_vmalloc(sizeof(*fsg) + (nvecs - 1) * sizeof(struct iovec));
+    // Pick the smallest class that fits; it rounds nvecs up to its size.
+    for (pool = 0; pool < KFIO_SGL_POOLS && nvecs > sgl_pool_nsegs[pool]; pool++)
+        ;
+
+    if (pool < KFIO_SGL_POOLS)
+    {
+        nvecs = sgl_pool_nsegs[pool];
+    }
+    else
+    {
+        pool = -1;
+    }
+
+    // The list is touched on every I/O to this card, so keep it on the
+    // card's socket rather than wherever the caller happens to run.
+    domain = pdev->numa_node >= 0 ? pdev->numa_node : kfio_numa_domain(node);
+
+    nsegs = nvecs;
+    rc = kfio_sgl_get_dma_tag(pdev, &nsegs, &tag);
+    if (rc)
+    {
+        *sgl = NULL;
+        return -rc;
+    }
+
+    if (pool < 0)
+    {
+        fsg = kfio_vmalloc(kfio_sgl_alloc_size(nvecs, nsegs));
+    }
+    else if (domain >= 0)
+    {
+        fsg = uma_zalloc_domain(sgl_pool_zone[pool], NULL, domain,
+                                M_WAITOK | (sgl_pool_reserve[pool] > 0 ? M_USE_RESERVE : 0));
+    }
+    else
+    {
+        fsg = uma_zalloc(sgl_pool_zone[pool],
+                         M_WAITOK | (sgl_pool_reserve[pool] > 0 ? M_USE_RESERVE : 0));
+    }
+
     if (NULL == fsg)
     {
+        *sgl = NULL;
         return -ENOMEM;
     }
 
+    fsg->pool = pool;
+
     fsg->uio_max  = nvecs;
     fsg->uio_num  = 0;
     fsg->uio_size = 0;
+    fsg->uio_segs = 0;
 
     fsg->seg_num = 0;
+    fsg->seg_max = nsegs;
     fsg->seg_ptr = NULL;
+    fsg->seg_buf = (bus_dma_segment_t *)&fsg->uio_vec[nvecs];
+    fsg->phys_buf = &fsg->seg_buf[nsegs];
+    fsg->seg_off = (uint32_t *)&fsg->phys_buf[nsegs];
+    fsg->seg_hint = 0;
 
     fsg->pci_dev = pcidev;
     fsg->pci_dir = 0;
@@ -93,18 +506,18 @@ kfio_sgl_alloc_nvec(kfio_pci_dev_t *pcidev, kfio_numa_node_t node, kfio_sg_list_
     fsg->dma_tag = NULL;
     fsg->dma_map = NULL;
 
-    rc = bus_dma_tag_create(pdev->parent_dma_tag, 1, 0, BUS_SPACE_MAXADDR,
-                            BUS_SPACE_MAXADDR, NULL, NULL,
-                            BUS_SPACE_MAXSIZE_32BIT, nvecs,
-                            BUS_SPACE_MAXSIZE_32BIT, BUS_DMA_ALLOCNOW,
-                            NULL, NULL, &fsg->dma_tag);
-    if (rc)
-       goto bail;
+    fsg->dma_direct = pdev->dma_direct;
+    fsg->dma_translated = pdev->dma_translated;
+    fsg->dma_loaded = 0;
+    fsg->dma_cached = 0;
+    fsg->phys_num = 0;
 
-    rc = bus_dmamap_create(fsg->dma_tag, 0, &fsg->dma_map);
+    rc = bus_dmamap_create(tag, 0, &fsg->dma_map);
     if (rc)
        goto bail;
 
+    fsg->dma_tag = tag;
+
     *sgl = fsg;
     return 0;
 
@@ -124,10 +537,23 @@ kfio_sgl_destroy(kfio_sg_list_t *sgl)
         if (fsg->seg_ptr != NULL)
            kfio_sgl_dma_unmap(fsg);
 
+        if (fsg->dma_cached)
+        {
+            bus_dmamap_unload(fsg->dma_tag, fsg->dma_map);
+            fsg->dma_cached = 0;
+        }
+
         bus_dmamap_destroy(fsg->dma_tag, fsg->dma_map);
-        bus_dma_tag_destroy(fsg->dma_tag);
     }
-    kfio_vfree(fsg, sizeof(*fsg) + (fsg->uio_max - 1) * sizeof(struct iovec));
+
+    if (fsg->pool >= 0)
+    {
+        uma_zfree(sgl_pool_zone[fsg->pool], fsg);
+    }
+    else
+    {
+        kfio_vfree(fsg, kfio_sgl_alloc_size(fsg->uio_max, fsg->seg_max));
+    }
 }
 
 void
@@ -140,6 +566,7 @@ kfio_sgl_reset(kfio_sg_list_t *sgl)
 
     fsg->uio_num  = 0;
     fsg->uio_size = 0;
+    fsg->uio_segs = 0;
 }
 
 uint32_t
@@ -192,47 +619,519 @@ kfio_sgl_map_page(kfio_sg_list_t *sgl, fusion_page_t page,
     return kfio_sgl_map_bytes(sgl, buffer, size);
 }
 
+/*
+ * Fills the segment array straight from the kernel page tables. Only valid
+ * when bus addresses are physical addresses for this device, i.e. no IOMMU
+ * translation and nothing the tag would bounce. Physically adjacent pages
+ * are merged the same way busdma would merge them. Returns 0 if the list
+ * does not fit in seg_max so the caller can take the busdma path.
+ */
+static int
+kfio_sgl_dma_map_direct(struct freebsd_sgl *fsg)
+{
+    bus_dma_segment_t *seg;
+    uint32_t i;
+    int      nsegs;
+
+    seg   = NULL;
+    nsegs = 0;
+
+    for (i = 0; i < fsg->uio_num; i++)
+    {
+        vm_offset_t va  = (vm_offset_t)fsg->uio_vec[i].iov_base;
+        bus_size_t  len = fsg->uio_vec[i].iov_len;
+
+        while (len > 0)
+        {
+            vm_paddr_t pa    = pmap_kextract(va);
+            bus_size_t chunk = MIN(len, PAGE_SIZE - (va & PAGE_MASK));
+
+            if (seg != NULL && seg->ds_addr + seg->ds_len == pa &&
+                seg->ds_len + chunk <= KFIO_SGL_MAX_SEG_LEN &&
+                KFIO_SGL_SAME_WINDOW(seg->ds_addr, seg->ds_len + chunk))
+            {
+                seg->ds_len += chunk;
+            }
+            else
+            {
+                if (nsegs == fsg->seg_max)
+                    return 0;
+
+                seg = &fsg->seg_buf[nsegs++];
+                seg->ds_addr = pa;
+                seg->ds_len  = chunk;
+            }
+
+            va  += chunk;
+            len -= chunk;
+        }
+    }
+    return nsegs;
+}
+
+/*
+ * This is what bus_dmamap_load_uio() does, except that segments land
+ * in our own array rather than in the tag's scratch array, which every
+ * SGL sharing the tag would otherwise race on. Returns the number of
+ * segments or a negative errno.
+ */
+static int
+kfio_sgl_dma_map_busdma(struct freebsd_sgl *fsg)
+{
+    bus_dma_segment_t *segs;
+    pmap_t   pmap;
+    uint32_t i;
+    int      nsegs;
+    int      rc;
+
+    if (fsg->uio_segflg == UIO_USERSPACE)
+        pmap = vmspace_pmap(fsg->uio_td->td_proc->p_vmspace);
+    else
+        pmap = kernel_pmap;
+
+    nsegs = -1;
+    rc = 0;
+
+    for (i = 0; i < fsg->uio_num && rc == 0; i++)
+    {
+        rc = _bus_dmamap_load_buffer(fsg->dma_tag, fsg->dma_map,
+                                     fsg->uio_vec[i].iov_base, fsg->uio_vec[i].iov_len,
+                                     pmap, BUS_DMA_NOWAIT | BUS_DMA_NOCACHE,
+                                     fsg->seg_buf, &nsegs);
+    }
+    nsegs++;
+
+    /*
+     * The array returned is the authoritative one: under DMAR it holds
+     * the translated bus addresses and need not be the one passed in.
+     */
+    segs = _bus_dmamap_complete(fsg->dma_tag, fsg->dma_map, fsg->seg_buf, nsegs, rc);
+
+    if (rc != 0)
+    {
+        bus_dmamap_unload(fsg->dma_tag, fsg->dma_map);
+        return -rc;
+    }
+    if (segs != fsg->seg_buf)
+    {
+        memcpy(fsg->seg_buf, segs, nsegs * sizeof(*segs));
+    }
+    return nsegs;
+}
+
+/*
+ * Folds physically adjacent segments together. Depending on the platform
+ * and whether a DMAR unit is translating, busdma may hand back one segment
+ * per page or per iovec even when the pages are contiguous, which costs the
+ * device a descriptor fetch each. Only our segment array is rewritten; the
+ * busdma map itself is untouched and is still unloaded as a whole.
+ */
+static int
+kfio_sgl_coalesce_segs(bus_dma_segment_t *segs, int nsegs)
+{
+    int i, n;
+
+    for (i = 1, n = 0; i < nsegs; i++)
+    {
+        if (segs[n].ds_addr + segs[n].ds_len == segs[i].ds_addr &&
+            segs[n].ds_len + segs[i].ds_len <= KFIO_SGL_MAX_SEG_LEN &&
+            KFIO_SGL_SAME_WINDOW(segs[n].ds_addr, segs[n].ds_len + segs[i].ds_len))
+        {
+            segs[n].ds_len += segs[i].ds_len;
+        }
+        else if (++n != i)
+        {
+            segs[n] = segs[i];
+        }
+    }
+    n++;
+
+    if (n < nsegs)
+        counter_u64_add(dma_map_segs_merged, nsegs - n);
+
+    return n;
+}
+
 /**
- * callback for loading dma map. If error we have failed.
+ * @brief maps a long-lived kernel buffer once and keeps the mapping until
+ * kfio_dma_unregister_buffer(). SGLs whose iovecs all fall inside registered
+ * buffers are then mapped without touching busdma. The caller must not free
+ * the buffer while it is registered.
  */
+int
+kfio_dma_register_buffer(kfio_pci_dev_t *pcidev, void *buffer, uint32_t size)
+{
+    struct kfio_freebsd_pci_dev *pdev = device_get_softc(pcidev);
+    struct kfio_dma_reg *reg;
+    bus_dma_segment_t *segs;
+    int nsegs;
+    int rc;
+
+    if (buffer == NULL || size == 0)
+    {
+        return -EINVAL;
+    }
+
+    nsegs = atop(round_page((vm_offset_t)buffer + size) - trunc_page((vm_offset_t)buffer));
+
+    reg = kfio_malloc(KFIO_DMA_REG_SIZE(nsegs));
+    if (reg == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    reg->pci_dev = pcidev;
+    reg->va      = (vm_offset_t)buffer;
+    reg->size    = size;
+    reg->seg_max = nsegs;
+
+    rc = bus_dma_tag_create(pdev->parent_dma_tag, 1, 0, BUS_SPACE_MAXADDR,
+                            BUS_SPACE_MAXADDR, NULL, NULL, size, nsegs,
+                            KFIO_SGL_MAX_SEG_LEN, 0, NULL, NULL, &reg->dma_tag);
+    if (rc != 0)
+    {
+        goto free_reg;
+    }
+
+    rc = bus_dmamap_create(reg->dma_tag, 0, &reg->dma_map);
+    if (rc != 0)
+    {
+        goto destroy_tag;
+    }
+
+    reg->seg_num = -1;
+    rc = _bus_dmamap_load_buffer(reg->dma_tag, reg->dma_map, buffer, size,
+                                 kernel_pmap, BUS_DMA_NOWAIT, reg->segs, &reg->seg_num);
+    reg->seg_num++;
+    segs = _bus_dmamap_complete(reg->dma_tag, reg->dma_map, reg->segs, reg->seg_num, rc);
+    if (rc != 0)
+    {
+        goto destroy_map;
+    }
+    if (segs != reg->segs)
+    {
+        memcpy(reg->segs, segs, reg->seg_num * sizeof(*segs));
+    }
+
+    reg->seg_num = kfio_sgl_coalesce_segs(reg->segs, reg->seg_num);
+
+    rm_wlock(&dma_reg_lock);
+    LIST_INSERT_HEAD(&dma_reg_list, reg, link);
+    dma_reg_count++;
+    rm_wunlock(&dma_reg_lock);
+
+    return 0;
+
+destroy_map:
+    bus_dmamap_destroy(reg->dma_tag, reg->dma_map);
+destroy_tag:
+    bus_dma_tag_destroy(reg->dma_tag);
+free_reg:
+    kfio_free(reg, KFIO_DMA_REG_SIZE(reg->seg_max));
+    return -rc;
+}
+
 static void
-_fusion_dmamap_callback(void *arg, bus_dma_segment_t *segs, int nsegs,
-                        bus_size_t size __unused, int error)
+kfio_dma_reg_release(struct kfio_dma_reg *reg)
+{
+    bus_dmamap_unload(reg->dma_tag, reg->dma_map);
+    bus_dmamap_destroy(reg->dma_tag, reg->dma_map);
+    bus_dma_tag_destroy(reg->dma_tag);
+    kfio_free(reg, KFIO_DMA_REG_SIZE(reg->seg_max));
+}
+
+void
+kfio_dma_unregister_buffer(kfio_pci_dev_t *pcidev, void *buffer)
 {
-    struct freebsd_sgl *fsg = arg;
+    struct kfio_dma_reg *reg;
 
-    if (0 == error)
+    rm_wlock(&dma_reg_lock);
+    LIST_FOREACH(reg, &dma_reg_list, link)
     {
-        fsg->seg_ptr = segs;
-        fsg->seg_num = nsegs;
+        if (reg->pci_dev == pcidev && reg->va == (vm_offset_t)buffer)
+        {
+            LIST_REMOVE(reg, link);
+            dma_reg_count--;
+            break;
+        }
     }
-    else
+    rm_wunlock(&dma_reg_lock);
+
+    if (reg != NULL)
     {
-        fsg->seg_ptr = NULL;
-        fsg->seg_num = 0;
+        kfio_dma_reg_release(reg);
+    }
+}
+
+/**
+ * called from iodrive_pci_remove() to drop registrations the core leaked
+ */
+void
+kfio_dma_registry_destroy(struct kfio_freebsd_pci_dev *pdev)
+{
+    LIST_HEAD(, kfio_dma_reg) stale = LIST_HEAD_INITIALIZER(stale);
+    struct kfio_dma_reg *reg, *next;
+
+    rm_wlock(&dma_reg_lock);
+    LIST_FOREACH_SAFE(reg, &dma_reg_list, link, next)
+    {
+        if (reg->pci_dev == pdev->dev)
+        {
+            LIST_REMOVE(reg, link);
+            LIST_INSERT_HEAD(&stale, reg, link);
+            dma_reg_count--;
+        }
+    }
+    rm_wunlock(&dma_reg_lock);
+
+    LIST_FOREACH_SAFE(reg, &stale, link, next)
+    {
+        kfio_dma_reg_release(reg);
+    }
+}
+
+/*
+ * Builds the segment array from registered mappings. Returns 0 when some
+ * iovec is not covered by a registration or the list does not fit in
+ * seg_max, so the caller falls back to busdma.
+ */
+static int
+kfio_sgl_dma_map_registered(struct freebsd_sgl *fsg)
+{
+    struct rm_priotracker tracker;
+    struct kfio_dma_reg *reg;
+    uint32_t i;
+    int      j;
+    int      nsegs;
+
+    nsegs = 0;
+    rm_rlock(&dma_reg_lock, &tracker);
+
+    for (i = 0; i < fsg->uio_num; i++)
+    {
+        vm_offset_t va  = (vm_offset_t)fsg->uio_vec[i].iov_base;
+        bus_size_t  len = fsg->uio_vec[i].iov_len;
+        bus_size_t  skip;
+
+        LIST_FOREACH(reg, &dma_reg_list, link)
+        {
+            if (reg->pci_dev == fsg->pci_dev && va >= reg->va &&
+                va - reg->va + len <= reg->size)
+            {
+                break;
+            }
+        }
+
+        if (reg == NULL)
+        {
+            nsegs = 0;
+            break;
+        }
+
+        skip = va - reg->va;
+
+        for (j = 0; j < reg->seg_num && len > 0; j++)
+        {
+            bus_size_t chunk;
+
+            if (skip >= reg->segs[j].ds_len)
+            {
+                skip -= reg->segs[j].ds_len;
+                continue;
+            }
+
+            if (nsegs == fsg->seg_max)
+            {
+                rm_runlock(&dma_reg_lock, &tracker);
+                return 0;
+            }
+
+            chunk = MIN(len, reg->segs[j].ds_len - skip);
+            fsg->seg_buf[nsegs].ds_addr = reg->segs[j].ds_addr + skip;
+            fsg->seg_buf[nsegs].ds_len  = chunk;
+            nsegs++;
+
+            len -= chunk;
+            skip = 0;
+        }
+    }
+
+    rm_runlock(&dma_reg_lock, &tracker);
+    return nsegs;
+}
+
+/*
+ * Walks the kernel pages behind the iovecs, merging physically adjacent
+ * chunks. With 'match' clear the chunks are recorded in phys_buf and their
+ * number returned, or 0 if they do not fit. With 'match' set they are
+ * compared against phys_buf instead and 1 is returned if identical.
+ */
+static int
+kfio_sgl_phys_walk(struct freebsd_sgl *fsg, int match)
+{
+    bus_dma_segment_t *seg;
+    bus_size_t used;
+    uint32_t   i;
+    int        n;
+
+    seg  = NULL;
+    used = 0;
+    n    = 0;
+
+    for (i = 0; i < fsg->uio_num; i++)
+    {
+        vm_offset_t va  = (vm_offset_t)fsg->uio_vec[i].iov_base;
+        bus_size_t  len = fsg->uio_vec[i].iov_len;
+
+        while (len > 0)
+        {
+            vm_paddr_t pa    = pmap_kextract(va);
+            bus_size_t chunk = MIN(len, PAGE_SIZE - (va & PAGE_MASK));
+
+            if (match)
+            {
+                if (n >= fsg->phys_num || fsg->phys_buf[n].ds_addr + used != pa ||
+                    fsg->phys_buf[n].ds_len - used < chunk)
+                {
+                    return 0;
+                }
+
+                used += chunk;
+                if (used == fsg->phys_buf[n].ds_len)
+                {
+                    n++;
+                    used = 0;
+                }
+            }
+            else if (seg != NULL && seg->ds_addr + seg->ds_len == pa)
+            {
+                seg->ds_len += chunk;
+            }
+            else
+            {
+                if (n == fsg->seg_max)
+                    return 0;
+
+                seg = &fsg->phys_buf[n++];
+                seg->ds_addr = pa;
+                seg->ds_len  = chunk;
+            }
+
+            va  += chunk;
+            len -= chunk;
+        }
+    }
+
+    return match ? (n == fsg->phys_num && used == 0) : n;
+}
+
+/*
+ * A load kept by dmar_lazy_unmap can be reused only if the new iovecs land
+ * on exactly the same physical bytes, since the IOMMU maps pages, not
+ * kernel addresses. Returns the kept segment count or 0 after dropping the
+ * stale load.
+ */
+static int
+kfio_sgl_dma_map_cached(struct freebsd_sgl *fsg)
+{
+    int nsegs = fsg->cache_segs;
+
+    fsg->dma_cached = 0;
+
+    if (fsg->uio_segflg == UIO_SYSSPACE && kfio_sgl_phys_walk(fsg, 1))
+    {
+        return nsegs;
+    }
+
+    bus_dmamap_unload(fsg->dma_tag, fsg->dma_map);
+    fsg->phys_num = 0;
+    counter_u64_add(dma_unmap_stale_count, 1);
+    return 0;
+}
+
+/*
+ * Records where each mapped segment starts so kfio_sgl_dma_slice() can
+ * binary search instead of walking the list from the start.
+ */
+static void
+kfio_sgl_build_offsets(struct freebsd_sgl *fsg)
+{
+    uint32_t offset;
+    int      i;
+
+    for (i = 0, offset = 0; i < fsg->seg_num; i++)
+    {
+        fsg->seg_off[i] = offset;
+        offset += fsg->seg_ptr[i].ds_len;
     }
+    fsg->seg_hint = 0;
 }
 
 int
 kfio_sgl_dma_map(kfio_sg_list_t *sgl, kfio_dma_map_t *dmap, int dir)
 {
     struct freebsd_sgl *fsg = sgl;
-    struct uio uio;
-    int rc;
+    uint64_t start;
+    int      nsegs;
 
-    uio.uio_segflg = fsg->uio_segflg;
-    uio.uio_td     = fsg->uio_td;
-    uio.uio_offset = 0;
-    uio.uio_rw     = (dir == IODRIVE_DMA_DIR_WRITE) ? UIO_WRITE : UIO_READ;
+    start = dma_map_stats ? get_cyclecount() : 0;
+    nsegs = 0;
 
-    uio.uio_resid  = fsg->uio_size;
-    uio.uio_iovcnt = fsg->uio_num;
-    uio.uio_iov    = fsg->uio_vec;
+    if (fsg->dma_cached)
+    {
+        nsegs = kfio_sgl_dma_map_cached(fsg);
+    }
 
-    rc = bus_dmamap_load_uio(fsg->dma_tag, fsg->dma_map, &uio,
-                             _fusion_dmamap_callback, fsg, BUS_DMA_NOCACHE);
-    if (rc != 0)
-        return -rc;
+    if (nsegs > 0)
+    {
+        fsg->dma_loaded = 1;
+        counter_u64_add(dma_map_reused_count, 1);
+    }
+    else if (fsg->dma_direct && dma_direct_map && fsg->uio_segflg == UIO_SYSSPACE &&
+             (nsegs = kfio_sgl_dma_map_direct(fsg)) > 0)
+    {
+        fsg->dma_loaded = 0;
+        counter_u64_add(dma_map_direct_count, 1);
+    }
+    else if (dma_reg_count > 0 && fsg->uio_segflg == UIO_SYSSPACE &&
+             (nsegs = kfio_sgl_dma_map_registered(fsg)) > 0)
+    {
+        if (nsegs > 1)
+            nsegs = kfio_sgl_coalesce_segs(fsg->seg_buf, nsegs);
+
+        fsg->dma_loaded = 0;
+        counter_u64_add(dma_map_registered_count, 1);
+    }
+    else
+    {
+        nsegs = kfio_sgl_dma_map_busdma(fsg);
+        if (nsegs < 0)
+            return nsegs;
+
+        if (dma_coalesce && nsegs > 1)
+            nsegs = kfio_sgl_coalesce_segs(fsg->seg_buf, nsegs);
+
+        fsg->dma_loaded = 1;
+        counter_u64_add(dma_map_busdma_count, 1);
+
+        // Remember which pages this load covers so it can be kept.
+        fsg->phys_num = 0;
+        if (fsg->dma_translated && dmar_lazy_unmap && fsg->uio_segflg == UIO_SYSSPACE)
+        {
+            fsg->phys_num = kfio_sgl_phys_walk(fsg, 0);
+        }
+    }
+
+    fsg->seg_ptr = fsg->seg_buf;
+    fsg->seg_num = nsegs;
+
+    kfio_sgl_build_offsets(fsg);
+
+    if (dma_map_stats)
+    {
+        counter_u64_add(fsg->dma_loaded ? dma_map_busdma_cycles : dma_map_direct_cycles,
+                        get_cyclecount() - start);
+    }
 
     /*
      * Fill in a map covering the whole scatter-gather list if caller is
@@ -255,10 +1154,27 @@ int
 kfio_sgl_dma_unmap(kfio_sg_list_t *sgl)
 {
     struct freebsd_sgl *fsg = sgl;
+    uint64_t start;
 
     if (fsg->seg_ptr != NULL)
     {
-        bus_dmamap_unload(fsg->dma_tag, fsg->dma_map);
+        if (fsg->dma_loaded && fsg->phys_num > 0 && dmar_lazy_unmap)
+        {
+            fsg->dma_loaded = 0;
+            fsg->dma_cached = 1;
+            fsg->cache_segs = fsg->seg_num;
+            counter_u64_add(dma_unmap_deferred_count, 1);
+        }
+        else if (fsg->dma_loaded)
+        {
+            start = dma_map_stats ? get_cyclecount() : 0;
+
+            bus_dmamap_unload(fsg->dma_tag, fsg->dma_map);
+            fsg->dma_loaded = 0;
+
+            if (dma_map_stats)
+                counter_u64_add(dma_map_busdma_cycles, get_cyclecount() - start);
+        }
         fsg->seg_ptr = NULL;
         fsg->seg_num = 0;
     }
@@ -399,76 +1315,108 @@ kfio_sgl_phys_next(kfio_sg_list_t *sgl, kfio_sgl_iter_t iter, kfio_sgl_phys_t *s
     return NULL;
 }
 
-kfio_dma_map_t *kfio_dma_map_alloc(int may_sleep, kfio_numa_node_t node)
+/*
+ * DMA maps are allocated and freed around every slice the core programs,
+ * so they come from their own zone and its per-CPU caches rather than
+ * from malloc(9).  A first-touch zone keeps them on the allocating CPU's
+ * domain without going through uma_zalloc_domain() and the keg lock.
+ */
+#if defined(UMA_ZONE_FIRSTTOUCH)
+#define KFIO_DMA_MAP_ZONE_FLAGS UMA_ZONE_FIRSTTOUCH
+#elif defined(UMA_ZONE_NUMA)
+#define KFIO_DMA_MAP_ZONE_FLAGS UMA_ZONE_NUMA
+#else
+#define KFIO_DMA_MAP_ZONE_FLAGS 0
+#endif
+
+static uma_zone_t dma_map_zone;
+
+static void
+kfio_dma_map_zone_init(void *arg __unused)
+{
+    dma_map_zone = uma_zcreate("fio_dma_map", sizeof(struct kfio_dma_map),
+                               NULL, NULL, NULL, NULL, UMA_ALIGN_PTR,
+                               KFIO_DMA_MAP_ZONE_FLAGS);
+}
+SYSINIT(fio_dma_map_zone, SI_SUB_DRIVERS, SI_ORDER_FIRST, kfio_dma_map_zone_init, NULL);
+
+static void
+kfio_dma_map_zone_fini(void *arg __unused)
 {
-    kfio_dma_map_t *dmap;
+    uma_zdestroy(dma_map_zone);
+}
+SYSUNINIT(fio_dma_map_zone, SI_SUB_DRIVERS, SI_ORDER_FIRST, kfio_dma_map_zone_fini, NULL);
 
-    if (may_sleep)
-    {
-        dmap = kfio_malloc(sizeof(*dmap));
-    }
-    else
-    {
-        dmap = kfio_malloc_atomic(sizeof(*dmap));
-    }
-    if (dmap != NULL)
-    {
-        kfio_memset(dmap, 0, sizeof(*dmap));
-    }
-    return dmap;
+kfio_dma_map_t *kfio_dma_map_alloc(int may_sleep, kfio_numa_node_t node)
+{
+    return uma_zalloc(dma_map_zone, M_ZERO | (may_sleep ? M_WAITOK : M_NOWAIT));
 }
 
 void kfio_dma_map_free(kfio_dma_map_t *dmap)
 {
     if (dmap != NULL)
     {
-        kfio_free(dmap, sizeof(*dmap));
+        uma_zfree(dma_map_zone, dmap);
     }
 }
 
-int kfio_sgl_dma_slice(kfio_sg_list_t *sgl, kfio_dma_map_t *dmap, uint32_t offset, uint32_t length)
+/*
+ * Returns the index of the mapped segment holding byte 'offset' of the list.
+ * Slices are usually requested in order, so the segment the previous slice
+ * ended in is tried before falling back to a binary search of seg_off[].
+ */
+static int
+kfio_sgl_find_seg(struct freebsd_sgl *fsg, uint32_t offset)
 {
-    struct freebsd_sgl *fsg = sgl;
-    uint32_t            i;
-
-    dmap->map_offset = offset;
+    int lo, hi, mid;
 
-    for (i = 0; i < fsg->seg_num; i++)
+    lo = fsg->seg_hint;
+    if (lo < fsg->seg_num && fsg->seg_off[lo] <= offset &&
+        offset - fsg->seg_off[lo] < fsg->seg_ptr[lo].ds_len)
     {
-        bus_dma_segment_t *seg = &fsg->seg_ptr[i];
+        return lo;
+    }
 
-        if (offset < seg->ds_len)
-        {
-            dmap->seg_first = seg;
-            dmap->seg_last  = seg;
+    lo = 0;
+    hi = fsg->seg_num - 1;
 
-            dmap->map_length = seg->ds_len - offset;
-            dmap->seg_skip   = offset;
-            dmap->seg_count  = 1;
-            break;
-        }
+    while (lo < hi)
+    {
+        mid = (lo + hi + 1) / 2;
 
-        offset -= seg->ds_len;
+        if (fsg->seg_off[mid] <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
     }
+    return lo;
+}
 
-    kassert(i < fsg->seg_num);
-    kassert(dmap->seg_first != NULL);
+int kfio_sgl_dma_slice(kfio_sg_list_t *sgl, kfio_dma_map_t *dmap, uint32_t offset, uint32_t length)
+{
+    struct freebsd_sgl *fsg = sgl;
+    bus_dma_segment_t  *last;
+    int                 first_idx, last_idx;
 
-    for (i = i + 1; i <= fsg->seg_num; i++)
-    {
-        bus_dma_segment_t *seg = &fsg->seg_ptr[i];
+    kassert(fsg->seg_ptr != NULL);
+    kassert(offset < fsg->uio_size);
+    kassert(length <= fsg->uio_size - offset);
 
-        if (dmap->map_length >= length)
-        {
-            dmap->seg_trunc   = dmap->map_length - length;
-            dmap->map_length -= dmap->seg_trunc;
-            break;
-        }
-        kassert(i < fsg->seg_num);
-        dmap->map_length += seg->ds_len;
-        dmap->seg_last    = seg;
-        dmap->seg_count++;
-    }
+    first_idx = kfio_sgl_find_seg(fsg, offset);
+    fsg->seg_hint = first_idx;
+
+    last_idx = length > 0 ? kfio_sgl_find_seg(fsg, offset + length - 1) : first_idx;
+    fsg->seg_hint = last_idx;
+
+    last = &fsg->seg_ptr[last_idx];
+
+    dmap->map_offset = offset;
+    dmap->map_length = length;
+    dmap->seg_first  = &fsg->seg_ptr[first_idx];
+    dmap->seg_last   = last;
+    dmap->seg_skip   = offset - fsg->seg_off[first_idx];
+    dmap->seg_trunc  = fsg->seg_off[last_idx] + last->ds_len - (offset + length);
+    dmap->seg_count  = last_idx - first_idx + 1;
 
     return 0;
 }
@@ -537,6 +1485,7 @@ int kfio_sgl_map_user_pages(kfio_sg_list_t *sgl, fusion_user_page_t *pages,
 {
     struct freebsd_sgl *fsg = sgl;
     void **p = (void **)pages;     // fusion_user_page_t is the userspace address
+    pmap_t pmap;
 
     if (fsg->uio_num != 0 && fsg->uio_segflg != UIO_USERSPACE)
     {
@@ -556,30 +1505,65 @@ int kfio_sgl_map_user_pages(kfio_sg_list_t *sgl, fusion_user_page_t *pages,
         return -ENOMEM;
     }
 
-    // Have to do each one individually, since iovecs from atomic writes mix
-    // and match addresses, so we don't know if things are contiguous or
-    // not.
+    // Iovecs from atomic writes mix and match addresses, so each page is
+    // checked individually and only folded into the previous iovec when it
+    // continues it in the user address space. Slicing works on byte offsets,
+    // so a folded iovec is indistinguishable to the core from the pages it
+    // covers. The pages are held by kfio_get_user_pages(), so their physical
+    // addresses are stable and tell us how many DMA segments the list will
+    // need; that, not the iovec count, is what bounds its size.
     fsg->uio_segflg = UIO_USERSPACE;
     fsg->uio_td = curthread;
 
+    pmap = vmspace_pmap(curthread->td_proc->p_vmspace);
+
     while (size > 0)
     {
-        uint32_t mapped_bytes;
+        struct iovec *prev;
+        char         *base;
+        vm_paddr_t    pa;
+        uint32_t      mapped_bytes;
+        int           virt_contig, new_seg;
 
-        if (fsg->uio_num >= fsg->uio_max)
+        base = (char *)*p++ + offset;
+        mapped_bytes = MIN(size, FUSION_PAGE_SIZE - offset);
+        prev = fsg->uio_num != 0 ? &fsg->uio_vec[fsg->uio_num - 1] : NULL;
+        pa   = pmap_extract(pmap, (vm_offset_t)base);
+
+        virt_contig = prev != NULL && (char *)prev->iov_base + prev->iov_len == base;
+        // Segments break where busdma and coalescing break them, so the
+        // count cannot come up short at map time.
+        new_seg     = !virt_contig || pa == 0 || pa != fsg->uio_pa_end ||
+                      pa + mapped_bytes - fsg->uio_pa_seg > KFIO_SGL_MAX_SEG_LEN ||
+                      !KFIO_SGL_SAME_WINDOW(fsg->uio_pa_seg, pa + mapped_bytes - fsg->uio_pa_seg);
+
+        if ((!virt_contig && fsg->uio_num >= fsg->uio_max) ||
+            (new_seg && fsg->uio_segs >= (uint32_t)fsg->seg_max))
         {
-            dbgprint(DBGS_GENERAL, "%s: too few sg entries (cnt: %u nvec: %d size: %d)\n",
-                     __func__, fsg->uio_num, fsg->uio_max, size);
+            dbgprint(DBGS_GENERAL, "%s: too few sg entries (cnt: %u nvec: %d segs: %u size: %d)\n",
+                     __func__, fsg->uio_num, fsg->uio_max, fsg->uio_segs, size);
 
             return -ENOMEM;
         }
 
-        mapped_bytes = MIN(size, FUSION_PAGE_SIZE - offset);
+        if (virt_contig)
+        {
+            prev->iov_len += mapped_bytes;
+        }
+        else
+        {
+            fsg->uio_vec[fsg->uio_num].iov_base = base;
+            fsg->uio_vec[fsg->uio_num].iov_len  = mapped_bytes;
+            fsg->uio_num++;
+        }
 
-        fsg->uio_vec[fsg->uio_num].iov_base = (char *)*p++ + offset;
-        fsg->uio_vec[fsg->uio_num].iov_len  = mapped_bytes;
-        fsg->uio_size += mapped_bytes;
-        fsg->uio_num++;
+        if (new_seg)
+        {
+            fsg->uio_segs++;
+            fsg->uio_pa_seg = pa;
+        }
+        fsg->uio_pa_end = pa + mapped_bytes;
+        fsg->uio_size  += mapped_bytes;
 
         size -= mapped_bytes;
         offset = 0;
@@ -587,3 +1571,149 @@ int kfio_sgl_map_user_pages(kfio_sg_list_t *sgl, fusion_user_page_t *pages,
 
     return 0;
 }
+
+#if defined(__amd64__)
+/*
+ * Copies with movnti so that a large span does not push the caller's
+ * working set out of the cache. Integer non-temporal stores need no FPU
+ * state, so unlike SSE/AVX streaming stores there is no fpu_kern_enter()
+ * to pay for on every call.
+ */
+static void
+kfio_sgl_copy_nt(void *dst, const void *src, size_t len)
+{
+    uint8_t       *d = dst;
+    const uint8_t *s = src;
+    size_t         head;
+
+    head = MIN(len, (size_t)(-(uintptr_t)d & 7));
+    if (head > 0)
+    {
+        memcpy(d, s, head);
+        d   += head;
+        s   += head;
+        len -= head;
+    }
+
+    while (len >= 64)
+    {
+        uint64_t       *d64 = (uint64_t *)d;
+        const uint64_t *s64 = (const uint64_t *)s;
+        int             i;
+
+        for (i = 0; i < 8; i++)
+        {
+            __asm __volatile("movnti %1, %0" : "=m" (d64[i]) : "r" (s64[i]));
+        }
+        d   += 64;
+        s   += 64;
+        len -= 64;
+    }
+
+    if (len > 0)
+    {
+        memcpy(d, s, len);
+    }
+
+    __asm __volatile("sfence" ::: "memory");
+}
+#endif
+
+/*
+ * Copies one span that lies within a single iovec of each list. Small
+ * kernel spans go through memcpy(), which is rep movs based on amd64.
+ */
+static int
+kfio_sgl_copy_span(struct freebsd_sgl *dsg, void *dp,
+                   struct freebsd_sgl *ssg, const void *sp, size_t len)
+{
+    if (ssg->uio_segflg == UIO_USERSPACE)
+        return -copyin(sp, dp, len);
+
+    if (dsg->uio_segflg == UIO_USERSPACE)
+        return -copyout(sp, dp, len);
+
+#if defined(__amd64__)
+    if (sgl_copy_nt_min > 0 && len >= (size_t)sgl_copy_nt_min)
+    {
+        kfio_sgl_copy_nt(dp, sp, len);
+        counter_u64_add(sgl_copy_nt_bytes, len);
+        return 0;
+    }
+#endif
+
+    memcpy(dp, sp, len);
+    return 0;
+}
+
+/*
+ * Copies the first 'length' bytes of src into dst, walking both iovec lists
+ * in step. A list of user addresses can only be copied from the thread that
+ * mapped it, and at most one side may be in user space.
+ */
+int kfio_sgl_copy_data(kfio_sg_list_t *dst, kfio_sg_list_t *src, uint32_t length)
+{
+    struct freebsd_sgl *dsg = dst;
+    struct freebsd_sgl *ssg = src;
+    uint32_t  di, si;
+    size_t    doff, soff;
+    uint64_t  start;
+    int       rc;
+
+    if (length > dsg->uio_size || length > ssg->uio_size)
+    {
+        return -EINVAL;
+    }
+
+    if (dsg->uio_segflg == UIO_USERSPACE && ssg->uio_segflg == UIO_USERSPACE)
+    {
+        return -EINVAL;
+    }
+
+    if ((dsg->uio_segflg == UIO_USERSPACE && dsg->uio_td != curthread) ||
+        (ssg->uio_segflg == UIO_USERSPACE && ssg->uio_td != curthread))
+    {
+        dbgprint(DBGS_GENERAL, "%s: user sg list copied from a foreign thread\n", __func__);
+        return -EFAULT;
+    }
+
+    start = dma_map_stats ? get_cyclecount() : 0;
+    counter_u64_add(sgl_copy_bytes, length);
+
+    di = si = 0;
+    doff = soff = 0;
+    rc = 0;
+
+    while (length > 0 && rc == 0)
+    {
+        struct iovec *dv = &dsg->uio_vec[di];
+        struct iovec *sv = &ssg->uio_vec[si];
+        size_t        len;
+
+        len = MIN(length, MIN(dv->iov_len - doff, sv->iov_len - soff));
+
+        rc = kfio_sgl_copy_span(dsg, (char *)dv->iov_base + doff,
+                                ssg, (const char *)sv->iov_base + soff, len);
+
+        length -= len;
+        doff   += len;
+        soff   += len;
+
+        if (doff == dv->iov_len)
+        {
+            di++;
+            doff = 0;
+        }
+        if (soff == sv->iov_len)
+        {
+            si++;
+            soff = 0;
+        }
+    }
+
+    if (dma_map_stats)
+    {
+        counter_u64_add(sgl_copy_cycles, get_cyclecount() - start);
+    }
+    return rc;
+}
@@ -182,6 +182,7 @@ freebsd_attach(device_t dev)
     pdev->unit = device_get_unit(dev);
 
     bioq_init(&pdev->bioq);
+    bioq_init(&pdev->discard_bioq);
 
     snprintf(pdev->pci_name, sizeof(pdev->pci_name), "%04x:%02x:%02x.%x",
 #if __FreeBSD_version >= 700053
@@ -323,12 +324,16 @@ init_fio_driver(void)
     if (rc != 0)
     {
         errprint("Device initialization failed: error %d.\n", rc);
+        fio_chunk_deinit();
         return ENXIO;
     }
 
     rc = fio_do_init();
     if (rc != 0)
+    {
+        fio_chunk_deinit();
         return rc;
+    }
 
     if ((rc = dbgs_create_flags_dir(&_dbgset)))
         errprint("Failed to create debug flags %d: %s\n",
@@ -344,6 +349,7 @@ cleanup_fio_driver(void)
     cleanup_fio_obj();
     cleanup_fio_iodrive();
     cleanup_fio_dev();
+    fio_chunk_deinit();
 }
 
 /******************************************************************************
@@ -116,7 +116,7 @@ int iodrive_pci_probe(struct kfio_freebsd_pci_dev *pd)
     }
 
     /** Get parent DMA tag **/
-    rc = bus_dma_tag_create(bus_get_dma_tag(pd->dev), 1, 0x100000000,
+    rc = bus_dma_tag_create(bus_get_dma_tag(pd->dev), 1, KFIO_DMA_BOUNDARY,
          BUS_SPACE_MAXADDR, BUS_SPACE_MAXADDR, NULL, NULL, BUS_SPACE_MAXSIZE,
          BUS_SPACE_UNRESTRICTED, BUS_SPACE_MAXSIZE,
          0, NULL, NULL, &pd->parent_dma_tag);
@@ -129,6 +129,22 @@ int iodrive_pci_probe(struct kfio_freebsd_pci_dev *pd)
         return -rc;
     }
 
+    /*
+     * Child tags inherit the domain, so coherent DMA memory is allocated
+     * on the socket the card hangs off.
+     */
+    if (bus_get_domain(pd->dev, &pd->numa_node) == 0)
+    {
+        bus_dma_tag_set_domain(pd->parent_dma_tag, pd->numa_node);
+    }
+    else
+    {
+        pd->numa_node = -1;
+    }
+
+    kfio_sgl_dma_probe_direct(pd);
+    kfio_dma_slab_init(pd);
+
     pd->fio_ich.ich_func = iodrive_pci_startup;
     pd->fio_ich.ich_arg  = pd;
 
@@ -139,6 +155,7 @@ int iodrive_pci_probe(struct kfio_freebsd_pci_dev *pd)
 
     if (rc < 0) /* cleanup and bail */
     {
+        kfio_dma_slab_destroy(pd);
         bus_dma_tag_destroy(pd->parent_dma_tag);
         pd->parent_dma_tag = NULL;
 
@@ -180,6 +197,10 @@ void iodrive_pci_remove(struct kfio_freebsd_pci_dev *pd)
         pd->bar_resource = NULL;
     }
 
+    kfio_dma_registry_destroy(pd);
+    kfio_dma_slab_destroy(pd);
+    kfio_sgl_dma_tags_destroy(pd);
+
     if (pd->parent_dma_tag != NULL)
     {
         bus_dma_tag_destroy(pd->parent_dma_tag);
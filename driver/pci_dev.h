@@ -38,6 +38,9 @@
 #include <sys/rman.h>
 #include <sys/bus.h>
 #include <sys/bio.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/queue.h>
 #include <machine/bus.h>
 #include <machine/resource.h>
 
@@ -46,6 +49,18 @@
 
 #define KFIO_PCI_NAME_LEN   13
 
+/* No DMA segment may cross a 4GB line; set on the device's parent tag. */
+#define KFIO_DMA_BOUNDARY   0x100000000ULL
+
+/* SGL DMA tags are shared per device, one per power-of-two segment count. */
+#define KFIO_SGL_DMA_TAG_CLASSES 16
+
+/* Small coherent DMA buffers are carved from chunks, one list per size class. */
+#define KFIO_DMA_SLAB_CLASSES    6
+
+struct kfio_dma_chunk;
+LIST_HEAD(kfio_dma_chunk_list, kfio_dma_chunk);
+
 /* kfio_pci_dev_t * will point to this in the FreeBSD port */
 struct kfio_freebsd_pci_dev
 {
@@ -60,7 +75,15 @@ struct kfio_freebsd_pci_dev
     struct intr_config_hook fio_ich;
 
     bus_dma_tag_t       parent_dma_tag; /* Unrestriced parent DMA tag. */
+    bus_dma_tag_t       sgl_dma_tag[KFIO_SGL_DMA_TAG_CLASSES]; /* shared by all SGLs */
+    int                 dma_direct;     /* bus address == physical address */
+    int                 dma_translated; /* an IOMMU remaps DMA addresses */
+    int                 numa_node;      /* memory domain of the slot, -1 if unknown */
+    struct mtx          dma_slab_lock;  /* protects dma_slab */
+    struct kfio_dma_chunk_list dma_slab[KFIO_DMA_SLAB_CLASSES];
+    int                 prealloc_done;  /* preallocate_memory share already taken */
     struct bio_queue_head bioq;
+    struct bio_queue_head discard_bioq;  /* deferred BIO_DELETE requests */
 
     void                *p_fio_device;   /* pointer to the fio_device owner */
     void                *prv;            /* private data */
@@ -70,4 +93,11 @@ struct kfio_freebsd_pci_dev
 extern int  iodrive_pci_probe(struct kfio_freebsd_pci_dev *pd);
 extern void iodrive_pci_remove(struct kfio_freebsd_pci_dev *pd);
 
+extern void kfio_sgl_dma_tags_destroy(struct kfio_freebsd_pci_dev *pd);
+extern void kfio_sgl_dma_probe_direct(struct kfio_freebsd_pci_dev *pd);
+extern void kfio_dma_registry_destroy(struct kfio_freebsd_pci_dev *pd);
+extern void kfio_dma_slab_init(struct kfio_freebsd_pci_dev *pd);
+extern void kfio_dma_slab_destroy(struct kfio_freebsd_pci_dev *pd);
+extern void kfio_prealloc_device(struct kfio_freebsd_pci_dev *pd);
+
 #endif // __KFIO_PORT_FREEBSD_PCI_DEV_H__
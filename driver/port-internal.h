@@ -68,3 +68,42 @@
 #  define PCIM_CMD_INTX_DISABLE 0x0400
 #endif
 
+/* Memory domain to allocate from for a core NUMA node, or -1 for any. */
+extern int kfio_numa_domain(kfio_numa_node_t node);
+
+/*
+ * Memory accounting. Each CPU keeps a running delta of bytes and objects
+ * and folds it into the shared totals once it passes a batch, which is
+ * also when the high-water marks are updated; they are therefore exact to
+ * within one batch per CPU.
+ */
+struct kfio_mem_acct_cpu
+{
+    long bytes;
+    long objs;
+} __aligned(CACHE_LINE_SIZE);
+
+struct kfio_mem_acct
+{
+    long                      bytes;
+    long                      objs;
+    long                      bytes_hwm;
+    long                      objs_hwm;
+    struct kfio_mem_acct_cpu *cpu;
+};
+
+struct sysctl_ctx_list;
+struct sysctl_oid;
+
+extern void kfio_mem_acct_init(struct kfio_mem_acct *acct);
+extern void kfio_mem_acct_fini(struct kfio_mem_acct *acct);
+extern void kfio_mem_acct_add(struct kfio_mem_acct *acct, long bytes, long objs);
+extern void kfio_mem_acct_sysctl(struct kfio_mem_acct *acct, struct sysctl_ctx_list *ctx,
+                                 struct sysctl_oid *oid);
+
+/* Preallocation for devices attached while preallocate_memory is set. */
+extern int        kfio_name_listed(const char *list, const char *name);
+extern int        kfio_prealloc_reserve(int count, fio_size_t size);
+extern fio_size_t kfio_cache_warm(int count, fio_size_t budget);
+extern fio_size_t kfio_sgl_pools_warm(int nrequests, fio_size_t budget);
+extern fio_size_t fio_chunk_reserved_bytes(void);